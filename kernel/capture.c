@@ -0,0 +1,275 @@
+// packet capture into a ring shared with a user process.
+// net.c passes every frame it receives or sends to capture_tap(),
+// which copies those the filter accepts into the next slot of
+// the ring, see capture.h. the reader takes frames from the ring
+// without a system call each.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "capture.h"
+#include "lwip/pbuf.h"
+
+static struct {
+  struct spinlock lock;
+  pagetable_t pagetable;  // process the ring is, or is being, mapped into
+  struct capring *ring;   // CAPPAGES pages, once mapped; 0 when idle
+  int next;               // slot the next frame goes to
+  // the reader can write the whole ring, so the kernel keeps its
+  // own copy of the sizes it publishes in struct capring.
+  uint32 nslots;
+  uint32 snaplen;
+  struct bpf_insn prog[CAPFILTER_MAX];
+  int plen;               // 0 captures every frame
+} cap;
+
+void
+captureinit(void)
+{
+  initlock(&cap.lock, "capture");
+}
+
+static struct capslot *
+slot(int i)
+{
+  return (struct capslot *)((char *)cap.ring + CAPSLOT0 + i * CAPSLOT);
+}
+
+// is prog a filter capture_tap() can run? jumps go forward
+// and stay inside the program, which ends with a return.
+static int
+filter_ok(struct bpf_insn *prog, int n)
+{
+  if(n == 0)
+    return 1;
+  if(n > CAPFILTER_MAX || (prog[n-1].code & 0x07) != BPF_RET)
+    return 0;
+
+  for(int pc = 0; pc < n; pc++){
+    struct bpf_insn *in = &prog[pc];
+    switch(in->code){
+    case BPF_LD|BPF_IMM:
+    case BPF_LDX|BPF_IMM:
+    case BPF_LD|BPF_W|BPF_ABS:
+    case BPF_LD|BPF_H|BPF_ABS:
+    case BPF_LD|BPF_B|BPF_ABS:
+    case BPF_LD|BPF_W|BPF_IND:
+    case BPF_LD|BPF_H|BPF_IND:
+    case BPF_LD|BPF_B|BPF_IND:
+    case BPF_LDX|BPF_B|BPF_MSH:
+    case BPF_ALU|BPF_AND|BPF_K:
+    case BPF_RET|BPF_K:
+    case BPF_RET|BPF_A:
+      break;
+    case BPF_JMP|BPF_JA:
+      if(in->k >= n - pc - 1)
+        return 0;
+      break;
+    case BPF_JMP|BPF_JEQ|BPF_K:
+    case BPF_JMP|BPF_JGT|BPF_K:
+    case BPF_JMP|BPF_JGE|BPF_K:
+    case BPF_JMP|BPF_JSET|BPF_K:
+      if(in->jt >= n - pc - 1 || in->jf >= n - pc - 1)
+        return 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// read size bytes at off in the frame, in network byte order.
+// the frame may be a chain of pbufs.
+static int
+load(struct pbuf *p, uint32 off, int size, uint32 *v)
+{
+  int b;
+
+  *v = 0;
+  for(int i = 0; i < size; i++){
+    if(off + i > 0xffff || (b = pbuf_try_get_at(p, off + i)) < 0)
+      return -1;
+    *v = *v << 8 | b;
+  }
+  return 0;
+}
+
+// run the filter on frame p. caller holds cap.lock.
+static uint32
+filter(struct pbuf *p)
+{
+  uint32 a = 0, x = 0, v;
+
+  for(int pc = 0; pc < cap.plen; pc++){
+    struct bpf_insn *in = &cap.prog[pc];
+    int size = (in->code & 0x18) == BPF_W ? 4 : (in->code & 0x18) == BPF_H ? 2 : 1;
+
+    switch(in->code){
+    case BPF_LD|BPF_IMM:
+      a = in->k;
+      break;
+    case BPF_LDX|BPF_IMM:
+      x = in->k;
+      break;
+    case BPF_LD|BPF_W|BPF_ABS:
+    case BPF_LD|BPF_H|BPF_ABS:
+    case BPF_LD|BPF_B|BPF_ABS:
+      if(load(p, in->k, size, &a) < 0)
+        return 0;
+      break;
+    case BPF_LD|BPF_W|BPF_IND:
+    case BPF_LD|BPF_H|BPF_IND:
+    case BPF_LD|BPF_B|BPF_IND:
+      if(load(p, x + in->k, size, &a) < 0)
+        return 0;
+      break;
+    case BPF_LDX|BPF_B|BPF_MSH:
+      // the length of the IP header at k
+      if(load(p, in->k, 1, &v) < 0)
+        return 0;
+      x = (v & 0xf) * 4;
+      break;
+    case BPF_ALU|BPF_AND|BPF_K:
+      a &= in->k;
+      break;
+    case BPF_JMP|BPF_JA:
+      pc += in->k;
+      break;
+    case BPF_JMP|BPF_JEQ|BPF_K:
+      pc += a == in->k ? in->jt : in->jf;
+      break;
+    case BPF_JMP|BPF_JGT|BPF_K:
+      pc += a > in->k ? in->jt : in->jf;
+      break;
+    case BPF_JMP|BPF_JGE|BPF_K:
+      pc += a >= in->k ? in->jt : in->jf;
+      break;
+    case BPF_JMP|BPF_JSET|BPF_K:
+      pc += (a & in->k) ? in->jt : in->jf;
+      break;
+    case BPF_RET|BPF_K:
+      return in->k;
+    case BPF_RET|BPF_A:
+      return a;
+    default:
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// called by net.c with every frame received (CAP_RX) or
+// about to be sent (CAP_TX), in lwIP context.
+void
+capture_tap(struct pbuf *p, int dir)
+{
+  // nobody is capturing: the common case
+  if(cap.ring == 0)
+    return;
+
+  acquire(&cap.lock);
+  if(cap.ring && (cap.plen == 0 || filter(p))){
+    struct capring *r = cap.ring;
+    struct capslot *s = slot(cap.next);
+
+    r->captured++;
+    if(s->status != CAP_KERNEL){
+      // the reader has fallen behind
+      r->drops++;
+    } else {
+      uint32 caplen = p->tot_len < cap.snaplen ? p->tot_len : cap.snaplen;
+      s->caplen = caplen;
+      s->len = p->tot_len;
+      s->dir = dir;
+      s->usec = r_mtime() / 10;
+      pbuf_copy_partial(p, s->data, caplen, 0);
+      // the frame must be in place before the reader sees it
+      __sync_synchronize();
+      s->status = CAP_USER;
+      cap.next = (cap.next + 1) % cap.nslots;
+    }
+  }
+  release(&cap.lock);
+}
+
+static void
+freering(void *ring)
+{
+  for(int i = 0; i < CAPPAGES; i++)
+    kfree((char *)ring + i * PGSIZE);
+}
+
+// start capturing the frames that pass the filter prog of n
+// instructions, into a ring mapped at CAPRING in the calling
+// process. one process can capture at a time.
+// returns CAPRING, or -1 on error.
+uint64
+capture_start(struct bpf_insn *prog, int n)
+{
+  struct proc *p = myproc();
+  char *ring;
+
+  if(!filter_ok(prog, n))
+    return -1;
+  if((ring = kallocn(CAPPAGES)) == 0)
+    return -1;
+  memset(ring, 0, CAPPAGES * PGSIZE);
+
+  acquire(&cap.lock);
+  if(cap.pagetable){
+    release(&cap.lock);
+    freering(ring);
+    return -1;
+  }
+  cap.pagetable = p->pagetable;
+  release(&cap.lock);
+
+  if(mappages(p->pagetable, CAPRING, CAPPAGES * PGSIZE, (uint64)ring, PTE_R | PTE_W | PTE_U) < 0){
+    acquire(&cap.lock);
+    cap.pagetable = 0;
+    release(&cap.lock);
+    freering(ring);
+    return -1;
+  }
+
+  struct capring *r = (struct capring *)ring;
+
+  acquire(&cap.lock);
+  cap.nslots = (CAPPAGES * PGSIZE - CAPSLOT0) / CAPSLOT;
+  cap.snaplen = CAPSLOT - sizeof(struct capslot);
+  r->nslots = cap.nslots;
+  r->snaplen = cap.snaplen;
+  memmove(cap.prog, prog, n * sizeof(*prog));
+  cap.plen = n;
+  cap.next = 0;
+  cap.ring = r;
+  release(&cap.lock);
+
+  return CAPRING;
+}
+
+// stop the capture, if its ring is mapped into pagetable.
+// called by capture() and when a page table is freed.
+// returns 0, or -1 if there was no such capture.
+int
+capture_stop(pagetable_t pagetable)
+{
+  acquire(&cap.lock);
+  struct capring *r = cap.ring;
+  if(r == 0 || cap.pagetable != pagetable){
+    release(&cap.lock);
+    return -1;
+  }
+  cap.ring = 0;
+  cap.pagetable = 0;
+  release(&cap.lock);
+
+  uvmunmap(pagetable, CAPRING, CAPPAGES * PGSIZE, 0);
+  freering(r);
+  return 0;
+}
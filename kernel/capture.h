@@ -0,0 +1,73 @@
+// packet capture, shared by the kernel and user programs.
+// capture() maps a ring of CAPPAGES pages into the calling process,
+// at the address it returns. the first page holds a struct capring,
+// and the rest are slots of CAPSLOT bytes, one frame each, used in
+// order. like Linux's PACKET_MMAP, each slot is owned by the kernel
+// or by the reader: the kernel fills a CAP_KERNEL slot and hands it
+// over by setting CAP_USER, and the reader gives it back by setting
+// CAP_KERNEL again. frames that find their slot still CAP_USER are
+// dropped, and counted.
+
+#define CAPSLOT     2048    // bytes per slot
+#define CAPSLOT0    4096    // offset of the first slot in the ring
+#define CAP_KERNEL  0       // slot status: free for the kernel to fill
+#define CAP_USER    1       // slot status: holds a frame for the reader
+
+#define CAP_RX      0       // frame direction: received
+#define CAP_TX      1       // frame direction: sent
+
+// the kernel only reads the status of slots, and never trusts
+// what the reader writes to this header.
+struct capring {
+  uint32 nslots;            // slots after the first page
+  uint32 snaplen;           // most bytes of a frame kept in a slot
+  uint64 captured;          // frames the filter accepted
+  uint64 drops;             // accepted frames that found no free slot
+};
+
+struct capslot {
+  volatile uint32 status;   // CAP_KERNEL or CAP_USER
+  uint32 caplen;            // bytes of the frame in data[]
+  uint32 len;               // length of the frame on the wire
+  uint32 dir;               // CAP_RX or CAP_TX
+  uint64 usec;              // time of capture, in microseconds since boot
+  uint8 data[];             // the first caplen bytes of the frame
+};
+
+// a filter is a program for a subset of the classic BPF machine,
+// which tcpdump -dd prints. it runs on each frame, from the
+// Ethernet header, and the frame is captured if it returns non-zero.
+// loads past the end of the frame reject it.
+#define CAPFILTER_MAX 64    // instructions in a filter, at most
+
+struct bpf_insn {
+  uint16 code;
+  uint8 jt;                 // jump offsets for true and false
+  uint8 jf;
+  uint32 k;
+};
+
+// instruction classes, sizes, modes and operations, as in BPF
+#define BPF_LD    0x00
+#define BPF_LDX   0x01
+#define BPF_ALU   0x04
+#define BPF_JMP   0x05
+#define BPF_RET   0x06
+#define BPF_W     0x00
+#define BPF_H     0x08
+#define BPF_B     0x10
+#define BPF_IMM   0x00
+#define BPF_ABS   0x20
+#define BPF_IND   0x40
+#define BPF_MSH   0xa0
+#define BPF_AND   0x50
+#define BPF_JA    0x00
+#define BPF_JEQ   0x10
+#define BPF_JGT   0x20
+#define BPF_JGE   0x30
+#define BPF_JSET  0x40
+#define BPF_K     0x00
+#define BPF_A     0x10
+
+#define BPF_STMT(code, k)         { (uint16)(code), 0, 0, k }
+#define BPF_JUMP(code, k, jt, jf) { (uint16)(code), jt, jf, k }
@@ -0,0 +1,255 @@
+// the Internet checksum (RFC 1071) for lwIP, LWIP_CHKSUM and
+// LWIP_CHKSUM_COPY in lwipopts.h. where lwIP's portable routine
+// adds up 16 bits at a time, these add 64-bit words into a 64-bit
+// sum and fold the carries back in, a word per load on rv64.
+// like lwIP's, the result is the 16-bit sum of the data's words
+// as loaded from memory, not inverted.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+// add w to the one's complement sum s, carry included.
+static inline uint64
+add64(uint64 s, uint64 w)
+{
+  s += w;
+  return s + (s < w);
+}
+
+// fold a 64-bit one's complement sum to 16 bits.
+static uint16
+fold64(uint64 s)
+{
+  s = (s & 0xffffffff) + (s >> 32);
+  s = (s & 0xffffffff) + (s >> 32);
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  return s;
+}
+
+static uint16
+swap16(uint16 s)
+{
+  return s << 8 | s >> 8;
+}
+
+// add the whole words of len bytes at an 8-byte aligned w to s.
+static uint64
+sum_aligned(const uint64 *w, int len, uint64 s)
+{
+  uint64 t = 0;
+
+  // two sums, so that the carries of one wait for the other
+  for(; len >= 32; len -= 32, w += 4){
+    s = add64(s, w[0]);
+    t = add64(t, w[1]);
+    s = add64(s, w[2]);
+    t = add64(t, w[3]);
+  }
+  for(; len >= 8; len -= 8)
+    s = add64(s, *w++);
+  return add64(s, t);
+}
+
+// the checksum of len bytes at data, at any alignment.
+uint16
+cksum(const void *data, int len)
+{
+  const uint8 *b = data;
+  uint64 s = 0;
+  uint16 t = 0;
+  int odd = (uint64)b & 1;
+
+  // from an odd address, sum as if one byte earlier, and swap
+  if(odd && len > 0){
+    ((uint8 *)&t)[1] = *b++;
+    s = t;
+    len--;
+  }
+  for(; len >= 2 && ((uint64)b & 7); len -= 2, b += 2)
+    s += *(uint16 *)b;
+
+  s = sum_aligned((const uint64 *)b, len, s);
+  b += len & ~7;
+  len &= 7;
+
+  if(len >= 4){
+    s = add64(s, *(uint32 *)b);
+    b += 4;
+    len -= 4;
+  }
+  if(len >= 2){
+    s = add64(s, *(uint16 *)b);
+    b += 2;
+    len -= 2;
+  }
+  if(len > 0){
+    t = 0;
+    ((uint8 *)&t)[0] = *b;
+    s = add64(s, t);
+  }
+
+  return odd ? swap16(fold64(s)) : fold64(s);
+}
+
+// copy len bytes from src to dst, and return their checksum, in
+// one pass over the data. the bytes up to an 8-byte boundary of
+// dst, and those after the last whole word, are copied first and
+// summed after. in between, dst takes aligned words, each made
+// from the two aligned words of src it straddles, so that src is
+// read a word at a time whatever its alignment. rv64 is
+// little-endian.
+uint16
+cksum_copy(void *dst, const void *src, int len)
+{
+  uint8 *d = dst;
+  const uint8 *s = src;
+  int head = (-(uint64)d) & 7;
+  uint64 sum = 0;
+
+  if(head > len)
+    head = len;
+  memmove(d, s, head);
+  int n = (len - head) & ~7;
+  uint64 *dw = (uint64 *)(d + head);
+  uint64 r = (uint64)(s + head) & 7;
+
+  if(r == 0){
+    const uint64 *sw = (const uint64 *)(s + head);
+    for(int i = 0; i < n / 8; i++){
+      dw[i] = sw[i];
+      sum = add64(sum, dw[i]);
+    }
+  } else if(n > 0){
+    // each word of src holds bytes that fall in one we need
+    const uint64 *sw = (const uint64 *)(s + head - r);
+    uint64 w0 = *sw++, w1;
+    int sh = r * 8;
+    for(int i = 0; i < n / 8; i++){
+      w1 = *sw++;
+      dw[i] = w0 >> sh | w1 << (64 - sh);
+      sum = add64(sum, dw[i]);
+      w0 = w1;
+    }
+  }
+  memmove(d + head + n, s + head + n, len - head - n);
+
+  // the words summed above start at offset head of the data
+  uint16 body = fold64(sum);
+  if(head & 1)
+    body = swap16(body);
+  sum = cksum(d, head);
+  sum += body;
+  sum += (head & 1) ? swap16(cksum(d + head + n, len - head - n))
+                    : cksum(d + head + n, len - head - n);
+  return fold64(sum);
+}
+
+// copyin() that also returns the checksum of what it copied,
+// for udp_sendto_chksum(). returns 0, or -1 on a bad address.
+int
+copyin_cksum(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len, uint16 *sum)
+{
+  uint64 n, va0, pa0, off = 0, s = 0;
+
+  while(len > 0){
+    va0 = PGROUNDDOWN(srcva);
+    pa0 = walkaddr(pagetable, va0);
+    if(pa0 == 0)
+      return -1;
+    n = PGSIZE - (srcva - va0);
+    if(n > len)
+      n = len;
+    uint16 c = cksum_copy(dst, (void *)(pa0 + (srcva - va0)), n);
+    s += (off & 1) ? swap16(c) : c;
+
+    len -= n;
+    dst += n;
+    off += n;
+    srcva = va0 + PGSIZE;
+  }
+  *sum = fold64(s);
+  return 0;
+}
+
+#ifdef BENCH
+// lwIP's portable routine, inet_chksum.c, which csum_bench()
+// measures these against.
+uint16 lwip_standard_chksum(const void *, int);
+
+// largest buffer of csum_bench()
+#define BENCH_MAX 65536
+
+// microbenchmark of the checksum routines: checksum, or copy and
+// checksum, a buffer of len bytes n times, with
+//   0: lwIP's lwip_standard_chksum()
+//   1: cksum()
+//   2: memmove() and then lwip_standard_chksum(), as lwIP copies
+//      without LWIP_CHKSUM_COPY
+//   3: cksum_copy()
+// the source and the destination are aligned differently, as
+// user data and the payload of a pbuf usually are. first checks
+// that the routines agree at every alignment.
+// returns the time taken, in CLINT_MTIME ticks, or -1.
+uint64
+csum_bench(int alg, int len, int n)
+{
+  int npages = BENCH_MAX / PGSIZE + 1;
+  char *src, *dst;
+  uint64 t = -1;
+
+  if(alg < 0 || alg > 3 || len < 0 || len > BENCH_MAX)
+    return -1;
+  if((src = kallocn(npages)) == 0)
+    return -1;
+  if((dst = kallocn(npages)) == 0)
+    goto out;
+
+  for(int i = 0; i < npages * PGSIZE; i++)
+    src[i] = (i * 2654435761u) >> 13;
+
+  for(int a = 0; a < 8; a++){
+    for(int b = 0; b < 8; b++){
+      uint16 want = lwip_standard_chksum(src + a, len);
+      if(cksum(src + a, len) != want ||
+         cksum_copy(dst + b, src + a, len) != want ||
+         memcmp(dst + b, src + a, len) != 0)
+        goto out;
+    }
+  }
+
+  char *s = src + 2, *d = dst + 6;
+  volatile uint16 sink;
+  uint64 start = *(volatile uint64 *)CLINT_MTIME;
+  for(int i = 0; i < n; i++){
+    switch(alg){
+    case 0:
+      sink = lwip_standard_chksum(s, len);
+      break;
+    case 1:
+      sink = cksum(s, len);
+      break;
+    case 2:
+      memmove(d, s, len);
+      sink = lwip_standard_chksum(d, len);
+      break;
+    case 3:
+      sink = cksum_copy(d, s, len);
+      break;
+    }
+  }
+  (void)sink;
+  t = *(volatile uint64 *)CLINT_MTIME - start;
+
+out:
+  for(int i = 0; i < npages; i++){
+    kfree(src + i * PGSIZE);
+    if(dst)
+      kfree(dst + i * PGSIZE);
+  }
+  return t;
+}
+#endif
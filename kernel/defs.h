@@ -11,6 +11,12 @@ struct superblock;
 struct socket;
 struct sockaddr;
 struct tcp_pcb;
+struct pbuf;
+struct virtqueue;
+struct virtq_seg;
+struct netstat;
+struct bpf_insn;
+struct pagepool;
 
 // bio.c
 void            binit(void);
@@ -66,6 +72,8 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kallocn(int);
+uint64          knfree(void);
 void            kfree(void *);
 void            kinit(void);
 
@@ -91,6 +99,9 @@ int             sockconnect(int, const struct sockaddr*, int);
 int             sockbind(int, const struct sockaddr*, int);
 int             socklisten(int, int);
 int             sockaccept(int, struct sockaddr*, int*);
+int             socksetopt(int, int, int, int);
+int             socksendmmsg(int, uint64, int, int);
+int             sockrecvmmsg(int, uint64, int, int);
 int             sockgethostbyname(const char*, struct sockaddr*);
 int             sockinetaddress(const char*, struct sockaddr*);
 
@@ -105,6 +116,7 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+struct proc*    kthreadcreate(void (*)(void), char*, int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -227,12 +239,68 @@ int lst_empty(struct list*);
 
 // extra files for lab net
 
+// slab.c
+void            slabinit(void);
+void*           kmalloc(uint64);
+void*           kmcalloc(uint64, uint64);
+void            kmfree(void *);
+void            slabstats(struct netstat *);
+
+// csum.c
+uint16          cksum(const void *, int);
+uint16          cksum_copy(void *, const void *, int);
+int             copyin_cksum(pagetable_t, char *, uint64, uint64, uint16 *);
+uint64          csum_bench(int, int, int);
+
+// pagepool.c
+void            pp_init(struct pagepool *, int);
+void            pp_grow(struct pagepool *, int);
+void*           pp_get(struct pagepool *);
+void            pp_put(struct pagepool *, void *);
+void            pp_stats(struct pagepool *, uint64 *, uint64 *, uint64 *, uint64 *);
+
+// capture.c
+void            captureinit(void);
+void            capture_tap(struct pbuf *, int);
+uint64          capture_start(struct bpf_insn *, int);
+int             capture_stop(pagetable_t);
+
 // net.c
 void            netinit(void);
-int             nettimer(void);
+void            netstart(void);
+int             netpoll(void);
+void            netfree(struct pbuf **, int);
+void            netcall(void (*)(void *), void *);
+void            netstats(struct netstat *);
+
+// virtq.c
+void            virtq_alloc(struct virtqueue *, int, uint64, int);
+void            virtq_free(struct virtqueue *);
+void            virtq_init(struct virtqueue *, uint64, int, int, int, uint64, int);
+int             virtq_room(struct virtqueue *, int);
+int             virtq_add(struct virtqueue *, struct virtq_seg *, int, int);
+int             virtq_ready(struct virtqueue *, int);
+int             virtq_pending(struct virtqueue *);
+int             virtq_peek(struct virtqueue *);
+int             virtq_get(struct virtqueue *, int *, int *);
+int             virtq_inflight(struct virtqueue *);
+int             virtq_kick(struct virtqueue *);
+void            virtq_enable_intr(struct virtqueue *, int);
+void            virtq_disable_intr(struct virtqueue *);
+uint64          virtq_bench(int, int);
 
 // virtio_net.c
 void            virtio_net_init(void *);
-int             virtio_net_send(const void *data, int len);
-int             virtio_net_recv(void *data, int len);
-void            virtio_net_intr(void);
\ No newline at end of file
+uint64          virtio_net_features(void);
+int             virtio_net_mtu(void);
+int             virtio_net_filter(uint8 *, int);
+int             virtio_net_send(struct pbuf *);
+void            virtio_net_txfree(void);
+int             virtio_net_recv(struct pbuf **, int);
+void            virtio_net_batch_begin(void);
+void            virtio_net_batch_end(void);
+void            virtio_net_wait(uint64);
+void            virtio_net_clock(void);
+void            virtio_net_wakeup(void);
+void            virtio_net_intr(void);
+void            virtio_net_stats(struct netstat *);
\ No newline at end of file
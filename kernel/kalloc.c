@@ -85,8 +85,55 @@ kalloc(void)
   return (void*)r;
 }
 
+// Allocate n physically contiguous pages, for device memory
+// such as virtqueue rings. Returns the lowest address, or 0.
+// kinit() leaves the free list in descending address order,
+// so a run of n list neighbours that are also neighbours in
+// memory is usually found near the head.
+void *
+kallocn(int n)
+{
+  struct run **pp, **start, *r;
+  int len;
+
+  if(n <= 0)
+    return 0;
+
+  acquire(&kmem.lock);
+  start = &kmem.freelist;
+  len = 0;
+  for(pp = &kmem.freelist; *pp; pp = &(*pp)->next){
+    if(len > 0 && (char*)*pp == (char*)(*start) - len*PGSIZE)
+      len++;
+    else {
+      start = pp;
+      len = 1;
+    }
+    if(len == n)
+      break;
+  }
+  if(len < n){
+    release(&kmem.lock);
+    return 0;
+  }
+  r = *pp;                  // lowest page of the run
+  *start = r->next;         // unlink the whole run
+  kmem.nfree -= n;
+  release(&kmem.lock);
+
+  memset((char*)r, 5, n*PGSIZE); // fill with junk
+  return (void*)r;
+}
+
+// the number of free pages.
 uint64
-sys_nfree(void)
+knfree(void)
 {
   return kmem.nfree;
 }
+
+uint64
+sys_nfree(void)
+{
+  return knfree();
+}
@@ -21,3 +21,5 @@
 void printf(char *, ...);
 void panic(char *) __attribute__((noreturn));
 unsigned long r_mtime(void);
+unsigned short cksum(const void *, int);
+unsigned short cksum_copy(void *, const void *, int);
@@ -8,9 +8,61 @@
 #define LWIP_ARP 1
 #define LWIP_DHCP 1
 #define LWIP_DNS 1
+#define LWIP_IGMP 1
 #define LWIP_ETHERNET 1
 
-#define LWIP_NETIF_LOOPBACK 1
+/* local traffic goes through net.c's own loopback interface,
+   which shares the data instead of copying it like lwIP's */
+#define LWIP_NETIF_LOOPBACK 0
+
+/* virtio-net lends its receive buffers to lwIP as custom pbufs */
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
+/* checksum offload is switched on per netif in linkinit() */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+
+/* checksums are summed 64 bits at a time by csum.c, and tcp_write()
+   checksums the data it copies in the same pass. lwIP's portable
+   routine is still built, for csum_bench() to compare against */
+#define LWIP_CHKSUM cksum
+#define LWIP_CHKSUM_ALGORITHM 2
+#define LWIP_CHECKSUM_ON_COPY 1
+#define LWIP_CHKSUM_COPY(dst, src, len) cksum_copy(dst, src, len)
+
+/* the MSS follows the largest MTU virtio-net configures, NETMTU in
+   param.h. lwIP clamps each connection's MSS to the MTU of its netif,
+   so a device without jumbo frames still gets 1460-byte segments */
+#include "kernel/param.h"
+#define TCP_MSS (NETMTU - 40)
+
+/* tcp_write() allocates room for this much more data than it is
+   given, for the next write to fill. lwIP defaults to TCP_MSS, which
+   would make every small write take a multi-page pbuf; keep it at
+   an Ethernet segment */
+#define TCP_OVERSIZE 1460
+
+/* bulk TCP sends are queued as segments of up to netif->tso_max bytes,
+   which virtio-net cuts into MSS-sized frames (HOST_TSO4). super-segments
+   are only built when the MSS is the full MTU of the netif, and the
+   send buffer must hold one. buffer and window sizes
+   are in bytes rather than in MSS, since they must fit in 16 bits */
+#define LWIP_TCP_TSO 1
+#define TCP_SND_BUF (44 * 1460)
+#define TCP_SNDLOWAT (TCP_SND_BUF / 4)
+#define TCP_SND_QUEUELEN 96
+#define MEMP_NUM_TCP_SEG TCP_SND_QUEUELEN
+
+/* a large receive window lets the NIC merge incoming segments into
+   packets of up to 64 KB (GUEST_TSO4). a socket's recv_buf holds a
+   whole window, so lwIP never has to keep refused data for long */
+#define TCP_WND (44 * 1460)
+
+/* a 64 KB UDP datagram arrives in up to 46 fragments of 1500 bytes */
+#define IP_REASS_MAX_PBUFS 48
+
+/* pool pbufs are chained as needed: keep them Ethernet-sized,
+   whatever the MSS */
+#define PBUF_POOL_BUFSIZE 1536
 
 #define LWIP_DEBUG 1
 //#define TCP_DEBUG LWIP_DBG_ON
@@ -18,5 +70,11 @@
 //#define NETIF_DEBUG LWIP_DBG_ON
 //#define ETHARP_DEBUG LWIP_DBG_ON
 
-#define MEM_USE_POOLS 1
-#define MEMP_USE_CUSTOM_POOLS 1
+/* lwIP's heap and its pools of PCBs, segments and pbufs all come from
+   the kernel's slab allocator, which grows with the load up to a share
+   of memory set at boot. see slab.c */
+#define MEM_LIBC_MALLOC 1
+#define MEMP_MEM_MALLOC 1
+#define mem_clib_malloc kmalloc
+#define mem_clib_free kmfree
+#define mem_clib_calloc kmcalloc
@@ -1,3 +0,0 @@
-LWIP_MALLOC_MEMPOOL_START
-LWIP_MALLOC_MEMPOOL(4, 2048)
-LWIP_MALLOC_MEMPOOL_END
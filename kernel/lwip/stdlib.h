@@ -0,0 +1,6 @@
+/* xv6 has no C library. lwIP's mem.c includes <stdlib.h> for
+   malloc() and free() with MEM_LIBC_MALLOC, which lwipopts.h maps
+   to the kernel's slab allocator, see slab.c */
+void *kmalloc(unsigned long);
+void *kmcalloc(unsigned long, unsigned long);
+void kmfree(void *);
@@ -21,6 +21,7 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // lwIP memory
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -32,9 +33,11 @@ main()
     iinit();         // inode cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
+    captureinit();   // packet capture
     netinit();       // network
     sockinit();      // socket
     userinit();      // first user process
+    netstart();      // network thread
     __sync_synchronize();
     started = 1;
   } else {
@@ -64,6 +64,8 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   CAPRING (packet capture ring, if capturing, see capture.c)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define CAPRING (TRAPFRAME - CAPPAGES*PGSIZE)
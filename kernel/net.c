@@ -4,69 +4,262 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "virtio.h"
+#include "netstat.h"
+#include "capture.h"
 #include "lwip/dhcp.h"
 #include "lwip/etharp.h"
 #include "lwip/init.h"
+#include "lwip/ip.h"
+#include "lwip/mem.h"
 #include "lwip/netif.h"
 #include "lwip/timeouts.h"
 
 struct netif netif;
+struct netif loif;
 struct spinlock lwip_lock;
 
+/* a call into lwIP from a system call, run by netd, see netcall() */
+struct netmsg {
+  void (*fn)(void *);
+  void *arg;
+  int done;
+  struct netmsg *next;
+};
+
+static struct {
+  struct spinlock lock;
+  struct netmsg *head;
+  struct netmsg **tail;
+} calls;
+
+static struct proc *netdproc;
+
+/* link-level counters, see netstat.h */
+static uint64 link_rx_drop;
+static uint64 link_tx_err;
+static uint64 busy_polls;
+static uint64 budget_used;
+static uint64 lo_packets;
+static uint64 lo_drop;
+
 err_t
 linkoutput(struct netif *netif, struct pbuf *p)
 {
-  struct pbuf *q;
-
-  for (q = p; q; q = q->next) {
-    if(virtio_net_send(q->payload, q->len))
-      return ERR_IF;
+  /* the whole chain goes out as one frame, without copying.
+     the driver queues bursts; if even its backlog is full and
+     we cannot wait, lwIP keeps the data and retries later */
+  capture_tap(p, CAP_TX);
+  if(virtio_net_send(p)){
+    __sync_fetch_and_add(&link_tx_err, 1);
+    return ERR_MEM;
   }
 
   return ERR_OK;
 }
 
+/* largest TCP segment handed to a NIC doing TSO, IP header included.
+   slab.c hands out runs of pages for pbufs of this size plus headers */
+#define TSO_MAX 65280
+
+/* frames taken off the RX ring per call of linkinput() */
+#define RX_BATCH 16
+
 int
 linkinput(struct netif *netif)
 {
-  int len;
-  struct pbuf *p;
+  int i, n;
+  struct pbuf *pkts[RX_BATCH];
+
+  /* the pbufs refer to the driver's receive buffers, no copy is made */
+  n = virtio_net_recv(pkts, RX_BATCH);
+
+  for(i = 0; i < n; i++){
+    if(!pkts[i])
+      continue;
+    capture_tap(pkts[i], CAP_RX);
+    if(netif->input(pkts[i], netif) != ERR_OK){
+      __sync_fetch_and_add(&link_rx_drop, 1);
+      pbuf_free(pkts[i]);
+    }
+  }
+
+  return n;
+}
+
+/* the loopback interface, 127.0.0.1/8. packets sent to it, or to
+   netif's own address, wait in lo.q until netd passes them to
+   ip_input(), since lwIP must not be entered again from its own
+   output path. like lwIP, the queue is protected by lwip_lock.
+   loopback traffic is not captured, see capture.c */
+#define LOQ   256   /* packets the queue holds; a power of two */
+#define LOHDR 128   /* bytes copied: IP and TCP headers, options included */
+
+static struct {
+  struct pbuf *q[LOQ];
+  uint head;              /* next packet to pass to lwIP */
+  uint tail;              /* next free slot */
+} lo;
+
+/* the data of a looped packet, referenced rather than copied */
+struct lo_pbuf {
+  struct pbuf_custom pc;  /* must be first */
+  struct pbuf *orig;      /* the sender's pbuf, which holds the data */
+};
+
+static void
+lo_pbuf_free(struct pbuf *p)
+{
+  struct lo_pbuf *lp = (struct lo_pbuf *)p;
+
+  pbuf_free(lp->orig);
+  mem_free(lp);
+}
+
+/* queue p for loopinput(). the receiving side rewrites headers in
+   place, and TCP keeps p for retransmission, so the headers are
+   copied; the data after them is shared with p, a custom pbuf for
+   each pbuf of the chain, which keeps a reference to it */
+static err_t
+lo_output(struct netif *ifp, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+  struct pbuf *r, *q;
+  u16_t off, hlen = LWIP_MIN(p->tot_len, LOHDR);
 
-  p = pbuf_alloc(PBUF_RAW, 1514, PBUF_RAM);
-  if(!p)
-    return 0;
+  if(lo.tail - lo.head == LOQ || (r = pbuf_alloc(PBUF_RAW, hlen, PBUF_RAM)) == NULL){
+    lo_drop++;
+    return ERR_MEM;
+  }
+  pbuf_copy_partial(p, r->payload, hlen, 0);
 
-  len = virtio_net_recv(p->payload, p->len);
+  for(off = hlen, q = p; q != NULL && off >= q->len; q = q->next)
+    off -= q->len;
+  for(; q != NULL; q = q->next, off = 0){
+    struct lo_pbuf *lp;
+    if(q->len == off)
+      continue;
+    if((lp = mem_malloc(sizeof(*lp))) == NULL){
+      pbuf_free(r);
+      lo_drop++;
+      return ERR_MEM;
+    }
+    lp->orig = q;
+    pbuf_ref(q);
+    lp->pc.custom_free_function = lo_pbuf_free;
+    pbuf_cat(r, pbuf_alloced_custom(PBUF_RAW, q->len - off, PBUF_REF, &lp->pc,
+                                    (u8_t *)q->payload + off, q->len - off));
+  }
 
-  if(len > 0){
-    /* shrink pbuf to actual size */
-    pbuf_realloc(p, len);
+  lo.q[lo.tail++ % LOQ] = r;
+  lo_packets++;
+  /* sent from a busy-polling reader, or before netd runs */
+  if(myproc() != netdproc)
+    virtio_net_wakeup();
+  return ERR_OK;
+}
 
-    printf("linkinput: received %d bytes\n", len);
-    if(netif->input(p, netif) == ERR_OK)
-      return len;
+/* pass the packets queued by lo_output() to lwIP. those that
+   lwIP sends back in turn wait for the next call.
+   returns the number of packets taken */
+static int
+loopinput(void)
+{
+  uint i, n = lo.tail - lo.head;
 
-    printf("linkinput: drop packet (%d bytes)\n", len);
+  for(i = 0; i < n; i++){
+    struct pbuf *p = lo.q[lo.head++ % LOQ];
+    if(loif.input(p, &loif) != ERR_OK){
+      lo_drop++;
+      pbuf_free(p);
+    }
   }
+  return n;
+}
 
-  pbuf_free(p);
-  return len;
+static err_t
+loinit(struct netif *ifp)
+{
+  /* nothing leaves the machine: no checksums at all, like Linux's
+     CHECKSUM_UNNECESSARY, and TCP segments of up to 64 KB */
+  NETIF_SET_CHECKSUM_CTRL(ifp, NETIF_CHECKSUM_DISABLE_ALL);
+  ifp->name[0] = 'l';
+  ifp->name[1] = 'o';
+  ifp->output = lo_output;
+  ifp->mtu = NETMTU;
+  ifp->tso_max = TSO_MAX;
+  return ERR_OK;
+}
+
+/* netif's output: packets to its own address go round
+   through the loopback interface, not through the NIC */
+static err_t
+linkoutput_ip(struct netif *ifp, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+  if(ip4_addr_cmp(ipaddr, netif_ip4_addr(ifp)))
+    return lo_output(&loif, p, ipaddr);
+  return etharp_output(ifp, p, ipaddr);
+}
+
+/* keep the NIC's multicast filter in step with the IGMP groups
+   lwIP has joined: 224.x.y.z maps to 01:00:5e plus its low 23 bits */
+static err_t
+linkfilter(struct netif *netif, const ip4_addr_t *group,
+           enum netif_mac_filter_action action)
+{
+  u32_t a = lwip_ntohl(ip4_addr_get_u32(group));
+  u8_t mac[ETH_HWADDR_LEN] = {
+    0x01, 0x00, 0x5e, (a >> 16) & 0x7f, (a >> 8) & 0xff, a & 0xff
+  };
+
+  if(virtio_net_filter(mac, action == NETIF_ADD_MAC_FILTER))
+    return ERR_IF;
+  return ERR_OK;
 }
 
 err_t
 linkinit(struct netif *netif)
 {
+  uint64 features;
+  u16_t chksum = NETIF_CHECKSUM_ENABLE_ALL;
+
   virtio_net_init(&netif->hwaddr);
 
+  /* leave TCP/UDP checksums to the NIC where it offered to do them */
+  features = virtio_net_features();
+  if(features & (1L << VIRTIO_NET_F_CSUM))
+    chksum &= ~(NETIF_CHECKSUM_GEN_TCP | NETIF_CHECKSUM_GEN_UDP);
+  if(features & (1L << VIRTIO_NET_F_GUEST_CSUM))
+    chksum &= ~(NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP);
+  NETIF_SET_CHECKSUM_CTRL(netif, chksum);
+
   netif->hwaddr_len = ETH_HWADDR_LEN;
   netif->linkoutput = linkoutput;
-  netif->output = etharp_output;
-  netif->mtu = 1500;
-  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_ETHERNET;
+  netif->output = linkoutput_ip;
+  netif->mtu = virtio_net_mtu();
+
+  /* let tcp_write() queue super-segments the NIC cuts to size */
+  if(features & (1L << VIRTIO_NET_F_HOST_TSO4))
+    netif->tso_max = TSO_MAX;
+  netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_ETHERNET |
+                 NETIF_FLAG_IGMP;
+  netif_set_igmp_mac_filter(netif, linkfilter);
 
   return ERR_OK;
 }
 
+static void
+loadd(void)
+{
+  ip4_addr_t addr, mask;
+
+  IP4_ADDR(&addr, 127, 0, 0, 1);
+  IP4_ADDR(&mask, 255, 0, 0, 0);
+  if(!netif_add(&loif, &addr, &mask, NULL, NULL, loinit, ip_input))
+    panic("loadd");
+  netif_set_link_up(&loif);
+  netif_set_up(&loif);
+}
+
 void
 netadd(void)
 {
@@ -104,25 +297,185 @@ netadd(void)
   printf("net: addr %s netmask %s gw %s\n", addr, netmask, gw);
 }
 
+/* run the calls system calls have queued with netcall().
+   caller holds lwip_lock */
+static void
+runcalls(void)
+{
+  struct netmsg *m, *next;
+
+  acquire(&calls.lock);
+  m = calls.head;
+  calls.head = 0;
+  calls.tail = &calls.head;
+  release(&calls.lock);
+
+  for(; m; m = next){
+    /* m is on the caller's stack, and gone once it is done */
+    next = m->next;
+    m->fn(m->arg);
+    acquire(&calls.lock);
+    m->done = 1;
+    wakeup(m);
+    release(&calls.lock);
+  }
+}
+
+/* run fn(arg) in the network thread, which owns lwIP, and wait
+   for it, like lwIP's tcpip_callback() with NO_SYS=0. system calls
+   on any CPU use this for every lwIP call they make, so that lwIP
+   only ever runs in netd, on NETCPU, or under lwip_lock in
+   netpoll() and netfree(). fn must not sleep */
+void
+netcall(void (*fn)(void *), void *arg)
+{
+  struct netmsg m = { fn, arg, 0, 0 };
+
+  /* lwIP callbacks already run in netd, and
+     nothing else does before netd starts */
+  if(myproc() == netdproc){
+    fn(arg);
+    return;
+  }
+  if(netdproc == 0){
+    acquire(&lwip_lock);
+    fn(arg);
+    release(&lwip_lock);
+    return;
+  }
+
+  acquire(&calls.lock);
+  *calls.tail = &m;
+  calls.tail = &m.next;
+  release(&calls.lock);
+
+  virtio_net_wakeup();
+
+  acquire(&calls.lock);
+  while(!m.done)
+    sleep(&m, &calls.lock);
+  release(&calls.lock);
+}
+
+/* the longest netd sleeps, in ms. whatever runs lwIP while netd
+   sleeps, and so may add a timeout, wakes it: netcall(),
+   lo_output() and netpoll(). the cap only bounds the sleep when
+   lwIP has no timeouts at all, and keeps ms * 10000 in 32 bits */
+#define NETD_MAXSLEEP 1000
+
+/* the network thread. runs the lwIP timeouts when they are due
+   and the calls of system calls, and feeds the frames the device
+   has received into lwIP and releases sent pbufs, in rounds of up
+   to NETBUDGET frames.
+   loopback packets count towards the budget too.
+   the NIC's receive interrupts stay off while rounds use their
+   whole budget: under load netd just yields the CPU between
+   rounds and polls again, and only sleeps, until the next
+   interrupt or timeout, once a round has found the rings empty.
+   the clock ticks every 100ms, which bounds how late a timeout
+   can run */
+static void
+netd(void)
+{
+  int n, got = 0;
+  u32_t ms;
+
+  for(;;){
+    if(got < NETBUDGET){
+      acquire(&lwip_lock);
+      ms = sys_timeouts_sleeptime();
+      release(&lwip_lock);
+      if(ms > NETD_MAXSLEEP)
+        ms = NETD_MAXSLEEP;
+      if(ms > 0)
+        virtio_net_wait(r_mtime() + ms * 10000);
+    } else {
+      __sync_fetch_and_add(&budget_used, 1);
+      yield();
+    }
+
+    acquire(&lwip_lock);
+    sys_check_timeouts();
+    runcalls();
+    virtio_net_batch_begin();
+    virtio_net_txfree();
+    for(got = 0; got < NETBUDGET; got += n)
+      if((n = linkinput(&netif) + loopinput()) == 0)
+        break;
+    virtio_net_batch_end();
+    release(&lwip_lock);
+  }
+}
+
+/* free pbufs that lwIP handed to a socket, from a system call.
+   like netpoll(), this runs lwIP outside netd, under lwip_lock */
+void
+netfree(struct pbuf **p, int n)
+{
+  acquire(&lwip_lock);
+  for(int i = 0; i < n; i++)
+    pbuf_free(p[i]);
+  release(&lwip_lock);
+}
+
+/* one pass of the network thread's work, for a process that
+   busy-polls a socket (SO_BUSY_POLL) instead of sleeping.
+   returns the number of frames received */
 int
-nettimer(void)
+netpoll(void)
 {
+  int n;
+
   acquire(&lwip_lock);
-  sys_check_timeouts();
-  int rc = linkinput(&netif);
+  virtio_net_batch_begin();
+  virtio_net_txfree();
+  n = linkinput(&netif) + loopinput();
+  virtio_net_batch_end();
   release(&lwip_lock);
-  return rc;
+  __sync_fetch_and_add(&busy_polls, 1);
+
+  /* the frames may have started lwIP timers that netd,
+     asleep until its last deadline, does not know about */
+  if(n > 0)
+    virtio_net_wakeup();
+  return n;
 }
 
 void
 netinit(void)
 {
   initlock(&lwip_lock, "lwip");
+  initlock(&calls.lock, "netcall");
+  calls.tail = &calls.head;
   lwip_init();
+  loadd();
   netadd();
   netif_set_default(&netif);
 }
 
+/* start the network thread, called from main.c
+   once the process table is ready */
+void
+netstart(void)
+{
+  netdproc = kthreadcreate(netd, "netd", NETCPU);
+}
+
+/* gather the network statistics for the netstat() system call */
+void
+netstats(struct netstat *st)
+{
+  memset(st, 0, sizeof(*st));
+  virtio_net_stats(st);
+  slabstats(st);
+  st->link_rx_drop = link_rx_drop;
+  st->link_tx_err = link_tx_err;
+  st->busy_polls = busy_polls;
+  st->budget_used = budget_used;
+  st->lo_packets = lo_packets;
+  st->lo_drop = lo_drop;
+}
+
 uint32
 sys_now(void)
 {
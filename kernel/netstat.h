@@ -0,0 +1,59 @@
+// network statistics, read with the netstat() system call.
+// the counters start at zero when the NIC is set up, and only grow.
+
+// batch sizes are counted in buckets: 0, 1, 2-3, 4-7, ..., 64 and up.
+#define NETSTAT_HIST 8
+
+// counters of one virtio-net queue pair, kept by virtio_net.c.
+struct netqstat {
+    uint64 rx_packets;      // packets handed to lwIP
+    uint64 rx_bytes;
+    uint64 rx_copied;       // packets copied since the page pool was empty
+    uint64 rx_drop_csum;    // dropped: bad TCP/UDP checksum
+    uint64 rx_drop_nomem;   // dropped: no pbuf to copy into
+    uint64 rx_drop_bad;     // dropped: bad num_buffers from the device
+    uint64 rx_kicks;        // notifications of refilled buffers
+    uint64 rx_polls;        // looks at the RX queue
+    uint64 rx_batch[NETSTAT_HIST];  // packets taken per poll
+
+    uint64 tx_packets;      // frames queued for the device
+    uint64 tx_bytes;
+    uint64 tx_ring_full;    // frames that found the ring full and waited
+    uint64 tx_drop_busy;    // refused: ring and backlog full, lwIP retries
+    uint64 tx_drop_nomem;   // refused: no pbuf to make a frame contiguous
+    uint64 tx_kicks;        // notifications of sent frames
+    uint64 tx_batch[NETSTAT_HIST];  // frames posted per notification
+};
+
+// counters of the slab allocator that holds lwIP's memory, see slab.c.
+// one entry per block size, and a last one for runs of whole pages.
+#define NETSTAT_SLABS 8
+
+struct netmemstat {
+    uint64 size;            // block size in bytes; a page for the last entry
+    uint64 inuse;           // blocks allocated now
+    uint64 peak;            // most blocks allocated at once
+    uint64 allocs;
+    uint64 fails;           // allocations refused at the memory limit
+};
+
+struct netstat {
+    int npairs;             // queue pairs in use
+    uint64 intrs;           // NIC interrupts
+    uint64 wakeups;         // times the network thread woke up
+    uint64 link_rx_drop;    // frames lwIP refused in linkinput()
+    uint64 link_tx_err;     // frames linkoutput() could not send
+    uint64 budget_used;     // netd rounds that used all of NETBUDGET
+    uint64 busy_polls;      // polls of the NIC by readers with SO_BUSY_POLL
+    uint64 lo_packets;      // packets sent through the loopback interface
+    uint64 lo_drop;         // of those, dropped: queue full or refused by lwIP
+    uint64 mem_pages;       // pages lwIP's memory takes now
+    uint64 mem_peak;        // the high-water mark of mem_pages
+    uint64 mem_limit;       // most pages lwIP may take
+    struct netmemstat mem[NETSTAT_SLABS];
+    uint64 rxpool_pages;    // pages in the receive page pool, see pagepool.c
+    uint64 rxpool_free;     // of those, free in the pool's shared stack
+    uint64 rxpool_trips;    // batches of pages moved to or from the shared stack
+    uint64 rxpool_empty;    // times a CPU found no free page
+    struct netqstat q[NCPU];
+};
@@ -0,0 +1,96 @@
+// page pool for packet buffers, see pagepool.h.
+// a page freed on a CPU goes to that CPU's cache, where the next
+// pp_get() on the same CPU finds it, still in the cache. only
+// when a cache runs empty or full does a CPU take the pool's
+// lock, to move PP_BATCH pages from or to the shared stack.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "pagepool.h"
+
+// set up an empty pool that can hold up to max pages.
+void
+pp_init(struct pagepool *pp, int max)
+{
+  int n = (max * sizeof(void *) + PGSIZE - 1) / PGSIZE;
+
+  initlock(&pp->lock, "pagepool");
+  if((pp->free = n == 1 ? kalloc() : kallocn(n)) == 0)
+    panic("pp_init");
+  pp->max = max;
+}
+
+// add n new pages to the pool.
+void
+pp_grow(struct pagepool *pp, int n)
+{
+  acquire(&pp->lock);
+  for(int i = 0; i < n && pp->npages < pp->max; i++){
+    void *pa = kalloc();
+    if(pa == 0)
+      panic("pp_grow");
+    memset(pa, 0, PGSIZE);
+    pp->free[pp->nfree++] = pa;
+    pp->npages++;
+  }
+  release(&pp->lock);
+}
+
+// take a free page, or return 0 if there is none.
+void *
+pp_get(struct pagepool *pp)
+{
+  void *pa = 0;
+
+  push_off();
+  int id = cpuid();
+  if(pp->cpu[id].n == 0){
+    acquire(&pp->lock);
+    while(pp->nfree > 0 && pp->cpu[id].n < PP_BATCH)
+      pp->cpu[id].page[pp->cpu[id].n++] = pp->free[--pp->nfree];
+    pp->trips++;
+    release(&pp->lock);
+  }
+  if(pp->cpu[id].n > 0)
+    pa = pp->cpu[id].page[--pp->cpu[id].n];
+  else
+    pp->cpu[id].empty++;
+  pop_off();
+  return pa;
+}
+
+// give a page from pp_get() back to the pool.
+void
+pp_put(struct pagepool *pp, void *pa)
+{
+  push_off();
+  int id = cpuid();
+  if(pp->cpu[id].n == PP_CACHE){
+    acquire(&pp->lock);
+    while(pp->cpu[id].n > PP_CACHE - PP_BATCH)
+      pp->free[pp->nfree++] = pp->cpu[id].page[--pp->cpu[id].n];
+    pp->trips++;
+    release(&pp->lock);
+  }
+  pp->cpu[id].page[pp->cpu[id].n++] = pa;
+  pop_off();
+}
+
+// the pool's counters: pages, free pages in the shared stack,
+// batches moved, and failed pp_get()s.
+void
+pp_stats(struct pagepool *pp, uint64 *npages, uint64 *nfree, uint64 *trips, uint64 *empty)
+{
+  *empty = 0;
+  for(int i = 0; i < NCPU; i++)
+    *empty += pp->cpu[i].empty;
+  acquire(&pp->lock);
+  *npages = pp->npages;
+  *nfree = pp->nfree;
+  *trips = pp->trips;
+  release(&pp->lock);
+}
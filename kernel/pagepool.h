@@ -0,0 +1,25 @@
+// a pool of pages for packet buffers, like Linux's page_pool.
+// virtio-net posts its pages to the RX ring, lends them to lwIP
+// as pbufs, and gets them back when lwIP frees the pbufs, without
+// kalloc() or kfree(). see pagepool.c.
+
+// free pages each CPU keeps for itself, and how many
+// move at a time between a CPU and the shared stack.
+#define PP_CACHE 32
+#define PP_BATCH 16
+
+struct pagepool {
+  // touched only by its own CPU, with interrupts off
+  struct {
+    void *page[PP_CACHE];
+    int n;
+    uint64 empty;           // pp_get() found no free page
+  } cpu[NCPU];
+
+  struct spinlock lock;     // protects the rest
+  void **free;              // shared stack of free pages
+  int nfree;
+  int npages;               // pages in the pool
+  int max;                  // room in free[]
+  uint64 trips;             // batches moved to or from free[]
+};
@@ -5,6 +5,16 @@
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define NSOCK        16  // maximum number of sockets
+#define NETRXRING   256  // virtio-net receive ring size, if the device allows
+#define NETTXRING   256  // virtio-net transmit ring size, if the device allows
+#define NETPACKED     1  // use packed virtio-net rings, if the device offers them
+#define NETMTU     9000  // largest virtio-net MTU, if the device allows
+#define NETBUDGET    64  // frames netd takes off the NIC before it yields the CPU
+#define NETBUSYPOLL 200  // most microseconds a blocked read may poll the NIC
+#define NETCPU        0  // CPU the network thread runs lwIP on
+#define NETMEMFRAC    8  // lwIP may hold 1/NETMEMFRAC of the memory free at boot
+#define NETRXPOOL   256  // receive pages beyond those posted to the rings, for lwIP to hold
+#define CAPPAGES     33  // pages of the packet capture ring, see capture.h
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
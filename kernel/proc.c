@@ -19,6 +19,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void wakeup1(struct proc *chan);
 
 extern char trampoline[]; // trampoline.S
@@ -107,6 +108,7 @@ allocproc(void)
 
 found:
   p->pid = allocpid();
+  p->cpu = -1;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -145,6 +147,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -179,6 +182,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, PGSIZE, 0);
   uvmunmap(pagetable, TRAPFRAME, PGSIZE, 0);
+  capture_stop(pagetable);
   if(sz > 0)
     uvmfree(pagetable, sz);
 }
@@ -221,6 +225,29 @@ userinit(void)
   release(&p->lock);
 }
 
+// Create a kernel thread that runs fn() in supervisor mode,
+// on CPU cpu only, unless it is -1.
+// It has no user memory and fn() must never return.
+struct proc*
+kthreadcreate(void (*fn)(void), char *name, int cpu)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthreadcreate");
+
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  p->cpu = cpu;
+  p->state = RUNNABLE;
+
+  release(&p->lock);
+  return p;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -457,14 +484,10 @@ scheduler(void)
     // cause a lost wakeup.
     intr_off();
 
-    // check for incoming packets
-    if (ticks % 5 == 0)
-      nettimer();
-
     int found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
-      if(p->state == RUNNABLE) {
+      if(p->state == RUNNABLE && (p->cpu < 0 || p->cpu == cpuid())) {
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
@@ -550,6 +573,24 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  // scheduler() runs with interrupts off, and unlike
+  // forkret() there is no sret to turn them back on.
+  intr_on();
+
+  p->kfn();
+  panic("kthreadret");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -0,0 +1,233 @@
+// Slab allocator for lwIP's heap and pools, see lwipopts.h.
+// Small blocks come from caches of one size each, which carve
+// kalloc() pages into blocks as they need them; larger ones take
+// whole runs of pages from kallocn(). lwIP may hold at most a share
+// of the memory that was free at boot, so that a flood of packets
+// cannot starve the rest of the kernel.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "netstat.h"
+
+// at the start of every page a cache owns, and of every large block.
+struct slab {
+  struct slab *next;      // cache's list of pages with free blocks
+  struct blk *free;       // free blocks in this page
+  int cache;              // index into caches[], or LARGE
+  int inuse;              // blocks handed out
+  int npages;             // pages of a large block
+};
+
+struct blk {
+  struct blk *next;
+};
+
+// the page header, rounded up so that blocks stay 16-byte aligned.
+#define HDR   ((sizeof(struct slab) + 15) & ~15)
+#define LARGE (NETSTAT_SLABS - 1)
+
+struct cache {
+  struct slab *partial;   // pages with free blocks
+  int npages;             // pages the cache owns
+};
+
+static struct {
+  struct spinlock lock;
+  struct cache caches[LARGE];
+  uint64 limit;           // pages lwIP may hold
+  uint64 pages;           // pages held
+  uint64 peak;            // most pages held at once
+  struct netmemstat st[NETSTAT_SLABS];
+} slab;
+
+// block sizes of the caches; two of the largest fit a page.
+static int
+cachesize(int c)
+{
+  return c == LARGE - 1 ? ((PGSIZE - HDR) / 2) & ~15 : 32 << c;
+}
+
+// the first cache that holds n bytes, or LARGE.
+static int
+cachefor(uint64 n)
+{
+  for(int c = 0; c < LARGE; c++)
+    if(n <= cachesize(c))
+      return c;
+  return LARGE;
+}
+
+// set the limit from the free memory, called
+// from main.c once kinit() has filled the free list.
+void
+slabinit(void)
+{
+  initlock(&slab.lock, "slab");
+  slab.limit = knfree() / NETMEMFRAC;
+  for(int c = 0; c < LARGE; c++)
+    slab.st[c].size = cachesize(c);
+  slab.st[LARGE].size = PGSIZE;
+}
+
+// count npages more pages held, if the limit allows.
+// caller holds slab.lock.
+static int
+charge(int npages)
+{
+  if(slab.pages + npages > slab.limit)
+    return -1;
+  slab.pages += npages;
+  if(slab.pages > slab.peak)
+    slab.peak = slab.pages;
+  return 0;
+}
+
+// a new page for cache c, cut into free blocks.
+// caller holds slab.lock.
+static struct slab *
+grow(int c)
+{
+  struct slab *s;
+  int size = cachesize(c);
+
+  if(charge(1) < 0)
+    return 0;
+  if((s = kalloc()) == 0){
+    slab.pages--;
+    return 0;
+  }
+  s->cache = c;
+  s->inuse = 0;
+  s->npages = 1;
+  s->free = 0;
+  for(char *b = (char *)s + PGSIZE - size; b >= (char *)s + HDR; b -= size){
+    ((struct blk *)b)->next = s->free;
+    s->free = (struct blk *)b;
+  }
+  s->next = slab.caches[c].partial;
+  slab.caches[c].partial = s;
+  slab.caches[c].npages++;
+  return s;
+}
+
+static void
+tally(int c, int ok)
+{
+  struct netmemstat *st = &slab.st[c];
+
+  if(!ok){
+    st->fails++;
+    return;
+  }
+  st->allocs++;
+  if(++st->inuse > st->peak)
+    st->peak = st->inuse;
+}
+
+// allocate n bytes for lwIP, mem_clib_malloc() in lwipopts.h.
+// returns 0 once lwIP holds its share of memory.
+void *
+kmalloc(uint64 n)
+{
+  struct slab *s;
+  int c = cachefor(n);
+
+  acquire(&slab.lock);
+  if(c == LARGE){
+    int npages = (n + HDR + PGSIZE - 1) / PGSIZE;
+    s = 0;
+    if(charge(npages) == 0 && (s = kallocn(npages)) == 0)
+      slab.pages -= npages;
+    tally(c, s != 0);
+    release(&slab.lock);
+    if(s == 0)
+      return 0;
+    s->cache = LARGE;
+    s->npages = npages;
+    return (char *)s + HDR;
+  }
+
+  if((s = slab.caches[c].partial) == 0)
+    s = grow(c);
+  tally(c, s != 0);
+  if(s == 0){
+    release(&slab.lock);
+    return 0;
+  }
+  struct blk *b = s->free;
+  s->free = b->next;
+  s->inuse++;
+  // a full page leaves the list until a block is freed
+  if(s->free == 0)
+    slab.caches[c].partial = s->next;
+  release(&slab.lock);
+  return b;
+}
+
+void *
+kmcalloc(uint64 count, uint64 size)
+{
+  void *p = kmalloc(count * size);
+  if(p)
+    memset(p, 0, count * size);
+  return p;
+}
+
+// free a block from kmalloc(). a cache gives an empty page
+// back to kalloc() unless it is the cache's only one.
+void
+kmfree(void *p)
+{
+  struct slab *s = (struct slab *)PGROUNDDOWN((uint64)p);
+  struct cache *cache;
+
+  acquire(&slab.lock);
+  slab.st[s->cache].inuse--;
+  if(s->cache == LARGE){
+    int npages = s->npages;
+    slab.pages -= npages;
+    release(&slab.lock);
+    for(int i = 0; i < npages; i++)
+      kfree((char *)s + i * PGSIZE);
+    return;
+  }
+
+  cache = &slab.caches[s->cache];
+  struct blk *b = p;
+  if(s->free == 0){
+    s->next = cache->partial;
+    cache->partial = s;
+  }
+  b->next = s->free;
+  s->free = b;
+  if(--s->inuse > 0 || cache->npages == 1){
+    release(&slab.lock);
+    return;
+  }
+
+  // unlink the empty page
+  struct slab **pp;
+  for(pp = &cache->partial; *pp != s; pp = &(*pp)->next)
+    ;
+  *pp = s->next;
+  cache->npages--;
+  slab.pages--;
+  release(&slab.lock);
+  kfree(s);
+}
+
+// copy the allocator's counters into st.
+void
+slabstats(struct netstat *st)
+{
+  acquire(&slab.lock);
+  st->mem_pages = slab.pages;
+  st->mem_peak = slab.peak;
+  st->mem_limit = slab.limit;
+  memmove(st->mem, slab.st, sizeof(slab.st));
+  release(&slab.lock);
+}
@@ -9,12 +9,26 @@
 #include "file.h"
 #include "socket.h"
 #include "lwip/tcp.h"
+#include "lwip/udp.h"
 #include "lwip/dns.h"
 #include "lwip/debug.h"
 #include "lwip/inet.h"
 
 struct socket sockets[NSOCK];
 
+// taken to claim or free a slot of sockets[], since socket() and
+// close() run on any hart, and accept() in netd
+struct spinlock sockets_lock;
+
+// traces of every segment and call on the data path, off by
+// default: a line on the UART takes longer than the path itself.
+#define SOCK_DEBUG 0
+#define sockdbg(...) do { if (SOCK_DEBUG) printf(__VA_ARGS__); } while (0)
+
+// datagrams per call into lwIP of sendmmsg() and recvmmsg(); their
+// struct mmsghdrs are copied to the kernel stack a batch at a time.
+#define MMSG_BATCH 16
+
 struct {
     struct spinlock lock;
     int sem;
@@ -26,6 +40,8 @@ void sockinit(void)
     // initialize the global DNS semaphore
     initlock(&dns_sem.lock, "dns");
     dns_sem.sem = 0;
+
+    initlock(&sockets_lock, "sockets");
 }
 
 static void sem_wait(struct spinlock *lock, int *sem)
@@ -38,6 +54,23 @@ static void sem_wait(struct spinlock *lock, int *sem)
     release(lock);
 }
 
+// poll the NIC for up to usec microseconds, or until sem is set,
+// instead of waiting for the network thread to be woken up by the
+// next interrupt. returns 1 if sem was set.
+static int sem_poll(struct spinlock *lock, int *sem, int usec)
+{
+    // CLINT_MTIME counts at 10 MHz in qemu
+    uint64 end = r_mtime() + (uint64)usec * 10;
+
+    while (*sem == 0 && r_mtime() < end)
+        netpoll();
+
+    acquire(lock);
+    int set = *sem;
+    release(lock);
+    return set;
+}
+
 static void sem_signal(struct spinlock *lock, int *sem)
 {
     acquire(lock);
@@ -50,6 +83,47 @@ static void sem_signal(struct spinlock *lock, int *sem)
 /* CALLBACK FUNCTIONS */
 
 
+// the receive ring is RECV_PAGES pages, which need not be
+// contiguous. copy n bytes of the pbuf chain p into it, from ring
+// position pos on.
+static void ring_put(struct socket *sock, int pos, struct pbuf *p, int n)
+{
+    for (int off = 0; off < n; ) {
+        int i = (pos + off) % RECV_BUFLEN;
+        int len = PGSIZE - i % PGSIZE;
+        if (len > n - off)
+            len = n - off;
+        pbuf_copy_partial(p, sock->recv_buf[i / PGSIZE] + i % PGSIZE, len, off);
+        off += len;
+    }
+}
+
+// copy n bytes of the receive ring, from position pos on, out to
+// addr in user space. returns 0, or -1 on a bad address.
+static int ring_copyout(struct socket *sock, int pos, pagetable_t pt, uint64 addr, int n)
+{
+    for (int off = 0; off < n; ) {
+        int i = (pos + off) % RECV_BUFLEN;
+        int len = PGSIZE - i % PGSIZE;
+        if (len > n - off)
+            len = n - off;
+        if (copyout(pt, addr + off, (char *)sock->recv_buf[i / PGSIZE] + i % PGSIZE, len) < 0)
+            return -1;
+        off += len;
+    }
+    return 0;
+}
+
+// free the pages of the receive ring, those there are.
+static void ring_free(struct socket *sock)
+{
+    for (int i = 0; i < RECV_PAGES; i++) {
+        if (sock->recv_buf[i] != NULL)
+            kfree((char *)sock->recv_buf[i]);
+        sock->recv_buf[i] = NULL;
+    }
+}
+
 err_t sock_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
 {
     struct socket *sock = (struct socket *)arg;
@@ -62,27 +136,21 @@ err_t sock_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
         return ERR_OK;
     }
     
-    // if p->len is larger than the available space in the ring buffer, store the packet for later
+    // if the data is larger than the available space in the ring buffer, store the packet for later
+    // p may be a chain, e.g. a large segment received in several buffers
     int avail_space = RECV_BUFLEN - (sock->recv_avail - sock->recv_used + 1);
-    if (p->len > avail_space) {
-        printf("sock_recv: no sufficient space in recv_buf\n");
-        printf("sock_recv: p->len = %d, avail_space = %d\n", p->len, avail_space);
+    if (p->tot_len > avail_space) {
+        sockdbg("sock_recv: no sufficient space in recv_buf\n");
+        sockdbg("sock_recv: p->tot_len = %d, avail_space = %d\n", p->tot_len, avail_space);
         return ERR_MEM;  // data will be stored in lwip's internal buffer
     }
     
-    // copy data from pbuf to socket ring buffer
-    int avail_ptr = sock->recv_avail % RECV_BUFLEN;
-    if (avail_ptr + p->len >= RECV_BUFLEN) {
-        int len1 = RECV_BUFLEN - avail_ptr - 1;
-        int len2 = p->len - len1;
-        memmove(sock->recv_buf + avail_ptr + 1, p->payload, len1);
-        memmove(sock->recv_buf, p->payload + len1, len2);
-    } else {
-        memmove(sock->recv_buf + avail_ptr + 1, p->payload, p->len);
-    }
-    sock->recv_avail += p->len;
+    // copy data from the pbuf chain to socket ring buffer,
+    // from the next free byte on
+    ring_put(sock, sock->recv_avail + 1, p, p->tot_len);
+    sock->recv_avail += p->tot_len;
 
-    printf("sock_recv: read %d bytes\n", p->len);
+    sockdbg("sock_recv: read %d bytes\n", p->tot_len);
 
     // inform lwip that we have read some data
     tcp_recved(sock->pcb, p->tot_len);
@@ -103,7 +171,7 @@ err_t sock_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
     
     sock->sent_len += len;
 
-    printf("sock_sent: sent %d bytes, waking up process\n", len);
+    sockdbg("sock_sent: sent %d bytes, waking up process\n", len);
 
     // wake up the process that is waiting for the data to be sent
     sem_signal(&sock->lock, &sock->sem);
@@ -191,9 +259,10 @@ err_t sock_accept(void *arg, struct tcp_pcb *newpcb, err_t err)
     newsock->state = SS_CONNECTED;
     sock_setup_callbacks(newsock);
 
-    // save the new pcb in the socket temporarily
-    // the pcb will be saved in the connected socket later
-    sock->accept_pcb = newpcb;
+    // save the peer for sockaccept(), which runs outside netd and
+    // must not look at newpcb: lwIP may free it at any time
+    sock->accept_ip = newpcb->remote_ip.addr;
+    sock->accept_port = htons(newpcb->remote_port);
     sock->accept_fd = newsockfd;
 
     // set socket state from SS_LISTENING to SS_ACCEPTING
@@ -226,6 +295,30 @@ void sock_dns_found(const char *name, const ip_addr_t *ipaddr, void *callback_ar
     sem_signal(&dns_sem.lock, &dns_sem.sem);
 }
 
+// callback function called when a datagram arrives on a UDP socket.
+// the pbuf itself waits in the socket's queue until it is read.
+void sock_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    struct socket *sock = (struct socket *)arg;
+
+    acquire(&sock->lock);
+    if (sock->dq_tail - sock->dq_head == SOCK_DGRAMQ) {
+        // the reader has fallen behind: drop the datagram
+        release(&sock->lock);
+        pbuf_free(p);
+        return;
+    }
+    struct dgram *d = &sock->dq[sock->dq_tail++ % SOCK_DGRAMQ];
+    d->p = p;
+    d->addr = ip4_addr_get_u32(addr);
+    d->port = port;
+
+    // wake up the process waiting in recvmmsg() or read()
+    sock->recv_sem = 1;
+    wakeup(&sock->recv_sem);
+    release(&sock->lock);
+}
+
 static void sock_setup_callbacks(struct socket *sock)
 {
     tcp_arg(sock->pcb, sock);
@@ -242,6 +335,218 @@ static void sock_setup_callbacks_accept(struct socket *sock)
 }
 
 
+/* CALLS INTO LWIP */
+
+
+// a call into lwIP on behalf of a system call. lwIP is not thread-safe,
+// so netcall() in net.c runs the do_*() functions below in the network
+// thread, and the system call waits for them. they must not sleep.
+struct sockmsg {
+    struct socket *sock;
+    ip_addr_t addr;         // do_connect(), do_bind(), do_dns()
+    u16_t port;             // do_connect(), do_bind()
+    pagetable_t pagetable;  // do_write(): the writer's, which buf is in
+    uint64 buf;             // do_write(): user address of the data
+    struct mmsghdr *msgs;   // do_sendmsgs(): the datagrams, data in pagetable
+    int off;                // do_write(): bytes of buf queued so far; do_sendmsgs(): datagrams sent
+    int n;                  // do_write(): bytes in buf; do_listen(): backlog; do_sendmsgs(): datagrams
+    const char *name;       // do_dns()
+    err_t err;              // result
+};
+
+static void do_new(void *arg)
+{
+    struct sockmsg *m = arg;
+    if (m->sock->type == SOCK_DGRAM) {
+        m->sock->upcb = udp_new();
+        if (m->sock->upcb != NULL)
+            udp_recv(m->sock->upcb, sock_udp_recv, m->sock);
+        return;
+    }
+    m->sock->pcb = tcp_new();
+}
+
+static void do_connect(void *arg)
+{
+    struct sockmsg *m = arg;
+    if (m->sock->type == SOCK_DGRAM) {
+        // a UDP socket only remembers its peer
+        m->err = udp_connect(m->sock->upcb, &m->addr, m->port);
+        return;
+    }
+    sock_setup_callbacks(m->sock);
+    m->err = tcp_connect(m->sock->pcb, &m->addr, m->port, sock_connected);
+}
+
+static void do_bind(void *arg)
+{
+    struct sockmsg *m = arg;
+    if (m->sock->type == SOCK_DGRAM)
+        m->err = udp_bind(m->sock->upcb, &m->addr, m->port);
+    else
+        m->err = tcp_bind(m->sock->pcb, &m->addr, m->port);
+}
+
+static void do_listen(void *arg)
+{
+    struct sockmsg *m = arg;
+    struct tcp_pcb *lpcb = tcp_listen_with_backlog(m->sock->pcb, m->n);
+    if (lpcb == NULL) {
+        m->err = ERR_MEM;
+        return;
+    }
+    // the old PCB is freed by tcp_listen_with_backlog()
+    m->sock->pcb = lpcb;
+    m->err = ERR_OK;
+}
+
+static void do_accept(void *arg)
+{
+    struct sockmsg *m = arg;
+    sock_setup_callbacks_accept(m->sock);
+}
+
+// queue as much of the rest of buf as lwIP's send buffer
+// takes, and send it. ERR_MEM means it is full, and the caller
+// should wait for sock_sent() before it tries again.
+// tcp_write() copies the data straight from the writer's pages,
+// through the kernel's direct map, and checksums it as it copies
+// (LWIP_CHKSUM_COPY, see csum.c): each byte is read once.
+static void do_write(void *arg)
+{
+    struct sockmsg *m = arg;
+    struct socket *sock = m->sock;
+    err_t err = ERR_OK;
+
+    while (m->off < m->n) {
+        // length of available space in send buffer
+        int avail_buf_len = tcp_sndbuf(sock->pcb);
+        if (avail_buf_len == 0) {
+            err = ERR_MEM;
+            break;
+        }
+
+        // the rest of the user page the data continues in
+        uint64 va = m->buf + m->off;
+        uint64 pa = walkaddr(m->pagetable, PGROUNDDOWN(va));
+        if (pa == 0) {
+            err = ERR_ARG;
+            break;
+        }
+        int page_len = PGSIZE - (va - PGROUNDDOWN(va));
+
+        // amount of data to send in this iteration
+        int to_write_len = m->n - m->off > avail_buf_len ? avail_buf_len : m->n - m->off;
+        if (to_write_len > page_len)
+            to_write_len = page_len;
+
+        // check if this is the last packet
+        uint8 write_flags = m->off + to_write_len == m->n ? TCP_WRITE_FLAG_COPY : TCP_WRITE_FLAG_MORE | TCP_WRITE_FLAG_COPY;
+        err = tcp_write(sock->pcb, (void *)(pa + (va - PGROUNDDOWN(va))), to_write_len, write_flags);
+        if (err != ERR_OK)
+            break;
+        m->off += to_write_len;
+    }
+
+    // send what has been queued; with ERR_MEM, this makes room
+    if (err == ERR_OK || err == ERR_MEM) {
+        err_t output_err = tcp_output(sock->pcb);
+        if (output_err != ERR_OK)
+            err = output_err;
+    }
+    m->err = err;
+}
+
+// send the datagrams of msgs, until one fails. each is copied from
+// user space into a pbuf and checksummed in the same pass.
+static void do_sendmsgs(void *arg)
+{
+    struct sockmsg *m = arg;
+    struct udp_pcb *pcb = m->sock->upcb;
+    err_t err = ERR_OK;
+
+    for (m->off = 0; m->off < m->n; m->off++) {
+        struct mmsghdr *mh = &m->msgs[m->off];
+        struct pbuf *p;
+        u16_t sum;
+
+        if (mh->msg_len < 0 || mh->msg_len > UDP_MAXLEN) {
+            err = ERR_VAL;
+            break;
+        }
+        if (mh->msg_name.sa_family != AF_INET && !(pcb->flags & UDP_FLAGS_CONNECTED)) {
+            err = ERR_CONN;
+            break;
+        }
+        if ((p = pbuf_alloc(PBUF_TRANSPORT, mh->msg_len, PBUF_RAM)) == NULL) {
+            err = ERR_MEM;
+            break;
+        }
+        if (copyin_cksum(m->pagetable, p->payload, (uint64)mh->msg_buf, mh->msg_len, &sum) < 0) {
+            pbuf_free(p);
+            err = ERR_ARG;
+            break;
+        }
+
+        if (mh->msg_name.sa_family == AF_INET) {
+            ip_addr_t addr = { mh->msg_name.sin_addr };
+            err = udp_sendto_chksum(pcb, p, &addr, ntohs(mh->msg_name.sin_port), 1, sum);
+        } else {
+            err = udp_send_chksum(pcb, p, 1, sum);
+        }
+        pbuf_free(p);
+        if (err != ERR_OK)
+            break;
+    }
+    m->err = err;
+}
+
+static void do_close(void *arg)
+{
+    struct sockmsg *m = arg;
+    struct socket *sock = m->sock;
+
+    if (sock->type == SOCK_DGRAM) {
+        udp_remove(sock->upcb);
+        // datagrams nobody read
+        while (sock->dq_head != sock->dq_tail)
+            pbuf_free(sock->dq[sock->dq_head++ % SOCK_DGRAMQ].p);
+        m->err = ERR_OK;
+        return;
+    }
+
+    // unset callbacks
+    tcp_recv(sock->pcb, NULL);
+    tcp_sent(sock->pcb, NULL);
+    tcp_err(sock->pcb, NULL);
+    tcp_poll(sock->pcb, NULL, 0);
+    tcp_accept(sock->pcb,NULL);
+
+    // TODO: The function may return ERR_MEM if no memory 
+    // was available for closing the connection. 
+    // If so, the application should wait and try again 
+    // either by using the acknowledgment callback or 
+    // the polling functionality.
+
+    // close connection and free pcb
+    m->err = tcp_close(sock->pcb);
+}
+
+static void do_dns(void *arg)
+{
+    struct sockmsg *m = arg;
+
+    // set DNS server address to Google's public DNS server
+    ip_addr_t dns_server = {
+        .addr = DNS_SERVER_IP,
+    };
+    dns_setserver(0, &dns_server);
+
+    // resolve hostname
+    m->err = dns_gethostbyname(m->name, &m->addr, sock_dns_found, &m->addr);
+}
+
+
 /* APIS FOR SERVER & CLIENT */
 
 
@@ -257,7 +562,9 @@ static int initsock(struct socket *sock)
     initlock(&sock->lock, "socket");
     
     sock->pcb = NULL;
-    sock->accept_pcb = NULL;
+    sock->upcb = NULL;
+    sock->accept_ip = 0;
+    sock->accept_port = 0;
     sock->accept_fd = -1;
 
     // ring buffer for received data
@@ -265,6 +572,10 @@ static int initsock(struct socket *sock)
     sock->recv_used = 0;
     sock->eof_reached = 0;
 
+    // queue of received datagrams
+    sock->dq_head = 0;
+    sock->dq_tail = 0;
+
     sock->owner = NULL;
 
     sock->file = NULL;
@@ -273,6 +584,8 @@ static int initsock(struct socket *sock)
     sock->sem = 0;
     sock->recv_sem = 0;
 
+    sock->busy_poll = 0;
+
     return 0;
 }
 
@@ -281,16 +594,18 @@ static int initsock(struct socket *sock)
 // returns a file descriptor on success, or -1 on error
 int sockalloc(int domain, int type, int protocol, struct tcp_pcb *pcb, struct proc *p) {
     LWIP_ASSERT("sockalloc: invalid domain", domain == AF_INET);
-    LWIP_ASSERT("sockalloc: invalid type", type == SOCK_STREAM);
+    LWIP_ASSERT("sockalloc: invalid type", type == SOCK_STREAM || type == SOCK_DGRAM);
     LWIP_ASSERT("sockalloc: invalid protocol", protocol == 0);  // TODO: make this an enum: IPPROTO_TCP
 
-    // allocate a free socket
+    // allocate a free socket; initsock() claims it
     int sock_idx;
+    acquire(&sockets_lock);
     for (sock_idx = 0; sock_idx < NSOCK; sock_idx++)
         if (sockets[sock_idx].state == SS_FREE)
             break;
 
     if (sock_idx == NSOCK) {
+        release(&sockets_lock);
         printf("sockalloc: no free sockets\n");
         return -1;
     }
@@ -298,10 +613,26 @@ int sockalloc(int domain, int type, int protocol, struct tcp_pcb *pcb, struct pr
     // initialize socket fields
     struct socket *s = &sockets[sock_idx];
     initsock(s);
+    release(&sockets_lock);
     s->domain = domain;
     s->type = type;
     s->protocol = protocol;
-    s->pcb = pcb == NULL ? tcp_new() : pcb;
+    // only TCP sockets have a byte ring, and only while they are open
+    for (int i = 0; type == SOCK_STREAM && i < RECV_PAGES; i++) {
+        if ((s->recv_buf[i] = kalloc()) != NULL)
+            continue;
+        printf("sockalloc: no memory for recv_buf\n");
+        ring_free(s);
+        acquire(&sockets_lock);
+        s->state = SS_FREE;
+        release(&sockets_lock);
+        return -1;
+    }
+    s->pcb = pcb;
+    if (pcb == NULL) {
+        struct sockmsg m = { .sock = s };
+        netcall(do_new, &m);
+    }
     s->owner = p == NULL ? myproc() : p;
 
     // allocate a fd for the socket
@@ -321,11 +652,81 @@ int sockalloc(int domain, int type, int protocol, struct tcp_pcb *pcb, struct pr
     return fd;
 }
 
+// take up to max datagrams off the queue of a UDP socket, waiting
+// for the first unless dontwait. returns the number taken.
+static int dgram_take(struct socket *sock, struct dgram *d, int max, int dontwait)
+{
+    for (;;) {
+        int n = 0;
+        acquire(&sock->lock);
+        while (n < max && sock->dq_head != sock->dq_tail)
+            d[n++] = sock->dq[sock->dq_head++ % SOCK_DGRAMQ];
+        release(&sock->lock);
+        if (n > 0 || dontwait)
+            return n;
+
+        // will be woken up by sock_udp_recv()
+        if (sock->busy_poll > 0)
+            sem_poll(&sock->lock, &sock->recv_sem, sock->busy_poll);
+        sem_wait(&sock->lock, &sock->recv_sem);
+    }
+}
+
+// copy up to n bytes of the datagram in p out to user space.
+// returns the number of bytes copied, or -1 on error.
+static int dgram_copyout(pagetable_t pt, uint64 addr, int n, struct pbuf *p)
+{
+    int off = 0;
+
+    if (n < 0)
+        return -1;
+    for (struct pbuf *q = p; q != NULL && off < n; q = q->next) {
+        int len = q->len < n - off ? q->len : n - off;
+        if (copyout(pt, addr + off, q->payload, len) < 0)
+            return -1;
+        off += len;
+    }
+    return off;
+}
+
+// read() on a UDP socket: one datagram, whatever of it fits.
+static int dgram_read(struct socket *sock, uint64 addr, int n)
+{
+    struct dgram d;
+
+    dgram_take(sock, &d, 1, 0);
+    int r = dgram_copyout(myproc()->pagetable, addr, n, d.p);
+    netfree(&d.p, 1);
+    return r;
+}
+
+// write() on a connected UDP socket: one datagram.
+static int dgram_write(struct socket *sock, uint64 addr, int n)
+{
+    struct mmsghdr mh = { .msg_buf = (void *)addr, .msg_len = n };
+    struct sockmsg m = {
+        .sock = sock,
+        .pagetable = myproc()->pagetable,
+        .msgs = &mh,
+        .n = 1,
+    };
+
+    netcall(do_sendmsgs, &m);
+    if (m.err != ERR_OK) {
+        printf("sockwrite: udp_send failed: %d\n", m.err);
+        return -1;
+    }
+    return n;
+}
+
 // called from fileread() in kernel/file.c
 // https://man7.org/linux/man-pages/man2/read.2.html
 // returns the number of bytes read on success, or -1 on error
 int sockread(struct socket *sock, uint64 addr, int n) 
 {
+    if (sock->type == SOCK_DGRAM)
+        return dgram_read(sock, addr, n);
+
     LWIP_ASSERT("sockread: invalid socket state", sock->state == SS_CONNECTED);
 
     // save recv_avail in case it is changed by the scheduler thread
@@ -344,7 +745,10 @@ int sockread(struct socket *sock, uint64 addr, int n)
         // will be woken up by tcp_poll() when data is available or EOF is received
         sock->state = SS_RECVING;
 
-        printf("sockread: waiting for some data\n");
+        // with SO_BUSY_POLL, first run lwIP on the packets as they
+        // arrive, which saves an interrupt and a wakeup of netd
+        if (sock->busy_poll == 0 || !sem_poll(&sock->lock, &sock->recv_sem, sock->busy_poll))
+            sockdbg("sockread: waiting for some data\n");
         sem_wait(&sock->lock, &sock->recv_sem);
 
         sock->state = SS_CONNECTED;
@@ -360,23 +764,9 @@ int sockread(struct socket *sock, uint64 addr, int n)
 
     // copy data from socket ring buffer to user buffer
     int to_read = num_avail < n ? num_avail : n;
-    pagetable_t pt = myproc()->pagetable;
-    int used_ptr = sock->recv_used % RECV_BUFLEN;
-    
-    // copy data in two parts if the data wraps around the end of the ring buffer
-    if (used_ptr + to_read >= RECV_BUFLEN) {
-        int len1 = RECV_BUFLEN - used_ptr;
-        int len2 = to_read - len1;
-        if (copyout(pt, addr, (char *)sock->recv_buf + used_ptr, len1) < 0 ||
-            copyout(pt, addr + len1, (char *)sock->recv_buf, len2) < 0) {
-            printf("sockread: copyout failed\n");
-            return -1;
-        }
-    } else {
-        if (copyout(pt, addr, (char *)sock->recv_buf + used_ptr, to_read) < 0) {
-            printf("sockread: copyout failed\n");
-            return -1;
-        }
+    if (ring_copyout(sock, sock->recv_used, myproc()->pagetable, addr, to_read) < 0) {
+        printf("sockread: copyout failed\n");
+        return -1;
     }
 
     // update recv_used pointer
@@ -390,17 +780,23 @@ int sockread(struct socket *sock, uint64 addr, int n)
 // returns the number of bytes written on success, or -1 on error
 int sockwrite(struct socket *sock, uint64 addr, int n) 
 {
+    if (sock->type == SOCK_DGRAM)
+        return dgram_write(sock, addr, n);
+
     LWIP_ASSERT("sockwrite: invalid socket state", sock->state == SS_CONNECTED);
 
-    // copy data from user space to kernel space
     if (n > SEND_BUFLEN) {
         printf("sockwrite: data too large (n < %d)\n", SEND_BUFLEN);
         return -1;
     }
-    
-    if (copyin(myproc()->pagetable, (char *)sock->send_buf, addr, n) < 0) {
-        printf("sockwrite: copyin failed\n");
-        return -1;
+
+    // do_write() reads the data from the user pages; check that
+    // they are there, as copyin() would
+    for (uint64 va = PGROUNDDOWN(addr); va < addr + n; va += PGSIZE) {
+        if (walkaddr(myproc()->pagetable, va) == 0) {
+            printf("sockwrite: bad address\n");
+            return -1;
+        }
     }
 
     // number of bytes sent so far
@@ -409,71 +805,49 @@ int sockwrite(struct socket *sock, uint64 addr, int n)
 
     // send data
     int sent_len = 0;
-    int written_len = 0;
-    err_t write_err, output_err;
+    struct sockmsg m = {
+        .sock = sock,
+        .pagetable = myproc()->pagetable,
+        .buf = addr,
+        .off = 0,
+        .n = n,
+    };
 
-    printf("sockwrite: sending %d bytes\n", n);
+    sockdbg("sockwrite: sending %d bytes\n", n);
 
     // send data in chunks due to limited send buffer size
-    // TODO: try to simplify this double loop
-    while (n-written_len > 0) {
-        while (1) {
-            // length of available space in send buffer
-            int avail_buf_len = tcp_sndbuf(sock->pcb); 
-
-            // amount of data to send in this iteration
-            int to_write_len = n-written_len > avail_buf_len ? avail_buf_len : n-written_len;
-
-            // check if this is the last packet
-            // TODO: TCP_WRITE_FLAG_MORE: do buffering except for the last packet
-            uint8 write_flags = written_len+to_write_len == n ? TCP_WRITE_FLAG_COPY : TCP_WRITE_FLAG_MORE | TCP_WRITE_FLAG_COPY;
-            write_err = tcp_write(sock->pcb, sock->send_buf+written_len, to_write_len, write_flags);
-
-            // if ERR_MEM: wait until some of the currently enqueued data has been successfully received
-            if (write_err == ERR_MEM) {
-                printf("sockwrite: tcp_write failed (ERR_MEM)\n");
-
-                // send buffer is full, try to send some data to make room
-                output_err = tcp_output(sock->pcb);
-                if (output_err != ERR_OK) {
-                    printf("sockwrite: tcp_output failed\n");
-                    return sent_len;
-                }
-
-                // will be woken up by sock_sent() when some data has been acknowledged
-                sem_wait(&sock->lock, &sock->sem);
-
-                // update number of bytes sent in this invocation
-                // sock->sent_len is updated by sock_sent()
-                sent_len = sock->sent_len - sent_len_old;
-
-                // retry tcp_write() if it failed due to insufficient memory
-                // there should be some free space in the send buffer now
-                continue;
-            }
+    while (1) {
+        netcall(do_write, &m);
 
-            // we don't handle other errors for now
-            if (write_err != ERR_OK) {
-                printf("sockwrite: tcp_write failed: %d\n", write_err);
-                return sent_len;
-            }
+        // if ERR_MEM: wait until some of the currently enqueued data has been successfully received
+        if (m.err == ERR_MEM) {
+            sockdbg("sockwrite: tcp_write failed (ERR_MEM)\n");
 
-            // successfully written to send buffer
-            written_len += to_write_len;
-            break;
+            // will be woken up by sock_sent() when some data has been acknowledged
+            sem_wait(&sock->lock, &sock->sem);
+
+            // update number of bytes sent in this invocation
+            // sock->sent_len is updated by sock_sent()
+            sent_len = sock->sent_len - sent_len_old;
+
+            // retry tcp_write() if it failed due to insufficient memory
+            // there should be some free space in the send buffer now
+            continue;
+        }
+
+        // we don't handle other errors for now
+        if (m.err != ERR_OK) {
+            printf("sockwrite: tcp_write or tcp_output failed: %d\n", m.err);
+            return sent_len;
         }
-    }
 
-    // some data may still be in the send buffer
-    output_err = tcp_output(sock->pcb);
-    if (output_err != ERR_OK) {
-        printf("sockwrite: tcp_output failed\n");
-        return sent_len;
+        // all data written to the send buffer and sent
+        break;
     }
 
     // will be woken up by sock_sent() when some data has been acknowledged
     // TODO: wake this process up in tcp_poll in case of missed wakeup
-    printf("sockwrite: waiting for data to be acknowledged\n");
+    sockdbg("sockwrite: waiting for data to be acknowledged\n");
     sem_wait(&sock->lock, &sock->sem);
 
     // update number of bytes sent in this invocation
@@ -490,31 +864,25 @@ void sockclose(struct socket *sock)
 {
     // socket could be in any state
 
-    // unset callbacks
-    tcp_recv(sock->pcb, NULL);
-    tcp_sent(sock->pcb, NULL);
-    tcp_err(sock->pcb, NULL);
-    tcp_poll(sock->pcb, NULL, 0);
-    tcp_accept(sock->pcb,NULL);
-
     // free file descriptor
     myproc()->ofile[sock->fd] = 0;
-    
-    // TODO: The function may return ERR_MEM if no memory 
-    // was available for closing the connection. 
-    // If so, the application should wait and try again 
-    // either by using the acknowledgment callback or 
-    // the polling functionality.
 
-    // close connection and free pcb
-    err_t err;
-    if ((err = tcp_close(sock->pcb)) != ERR_OK) {
+    // unset callbacks, close connection and free pcb
+    struct sockmsg m = { .sock = sock };
+    netcall(do_close, &m);
+    if (m.err != ERR_OK) {
         printf("sockclose: tcp_close failed\n");
     }
 
+    // netd calls no more callbacks for this socket
+    ring_free(sock);
+
     // free socket
+    acquire(&sockets_lock);
     sock->state = SS_FREE;
+    release(&sockets_lock);
     sock->pcb = NULL;   // should not be referenced anymore after tcp_close()
+    sock->upcb = NULL;
 }
 
 
@@ -531,17 +899,34 @@ int sockconnect(int sockfd, const struct sockaddr *addr, int addrlen)
         printf("sockconnect: invalid socket\n");
         return -1;
     }
+
+    if (sock->type == SOCK_DGRAM) {
+        struct sockmsg m = {
+            .sock = sock,
+            .addr = {addr->sin_addr},
+            .port = ntohs(addr->sin_port),
+        };
+        netcall(do_connect, &m);
+        if (m.err != ERR_OK) {
+            printf("sockconnect: udp_connect failed: %d\n", m.err);
+            return -1;
+        }
+        sock->state = SS_CONNECTED;
+        return 0;
+    }
     
     // set socket state from SS_UNCONNECTED to SS_CONNECTING
     LWIP_ASSERT("sockconnect: invalid socket state", sock->state == SS_UNCONNECTED);
     sock->state = SS_CONNECTING;
-    
-    sock_setup_callbacks(sock);
 
-    ip_addr_t ipaddr = {addr->sin_addr};
-    err_t err = tcp_connect(sock->pcb, &ipaddr, ntohs(addr->sin_port), sock_connected);
-    if (err != ERR_OK) {
-        printf("sockconnect: tcp_connect failed: %d\n", err);
+    struct sockmsg m = {
+        .sock = sock,
+        .addr = {addr->sin_addr},
+        .port = ntohs(addr->sin_port),
+    };
+    netcall(do_connect, &m);
+    if (m.err != ERR_OK) {
+        printf("sockconnect: tcp_connect failed: %d\n", m.err);
         return -1;
     }
 
@@ -558,6 +943,116 @@ int sockconnect(int sockfd, const struct sockaddr *addr, int addrlen)
 }
 
 
+// called from sys_sendmmsg() in kernel/sysfile.c
+// https://man7.org/linux/man-pages/man2/sendmmsg.2.html
+// sends the vlen datagrams described by the mmsghdrs at vec, to
+// msg_name, or to the connected peer if its sa_family is 0, up to
+// MMSG_BATCH of them per call into lwIP. no flags are supported.
+// returns the number sent, or -1 if none could be
+int socksendmmsg(int sockfd, uint64 vec, int vlen, int flags)
+{
+    struct socket *sock = myproc()->ofile[sockfd]->sock;
+    pagetable_t pagetable = myproc()->pagetable;
+    struct mmsghdr mh[MMSG_BATCH];
+    int sent = 0;
+
+    if (sock == NULL || sock->type != SOCK_DGRAM || vlen < 0 || flags != 0)
+        return -1;
+
+    while (sent < vlen) {
+        int n = vlen - sent < MMSG_BATCH ? vlen - sent : MMSG_BATCH;
+        if (copyin(pagetable, (char *)mh, vec + sent * sizeof(mh[0]), n * sizeof(mh[0])) < 0)
+            break;
+
+        struct sockmsg m = {
+            .sock = sock,
+            .pagetable = pagetable,
+            .msgs = mh,
+            .n = n,
+        };
+        netcall(do_sendmsgs, &m);
+        sent += m.off;
+        if (m.err != ERR_OK) {
+            printf("socksendmmsg: udp_sendto failed: %d\n", m.err);
+            break;
+        }
+    }
+    return sent > 0 || vlen == 0 ? sent : -1;
+}
+
+// called from sys_recvmmsg() in kernel/sysfile.c
+// https://man7.org/linux/man-pages/man2/recvmmsg.2.html
+// receives up to vlen datagrams into the mmsghdrs at vec, setting
+// msg_name to the sender, msg_len to the bytes copied, and
+// MSG_TRUNC in msg_flags if the datagram did not fit. waits for the
+// first datagram, unless MSG_DONTWAIT, but not for the rest.
+// returns the number received, or -1 on error
+int sockrecvmmsg(int sockfd, uint64 vec, int vlen, int flags)
+{
+    struct socket *sock = myproc()->ofile[sockfd]->sock;
+    pagetable_t pagetable = myproc()->pagetable;
+    struct dgram d[MMSG_BATCH];
+    struct pbuf *p[MMSG_BATCH];
+    int got = 0, err = 0;
+
+    if (sock == NULL || sock->type != SOCK_DGRAM || vlen < 0 || (flags & ~MSG_DONTWAIT))
+        return -1;
+
+    while (got < vlen && !err) {
+        int max = vlen - got < MMSG_BATCH ? vlen - got : MMSG_BATCH;
+        int n = dgram_take(sock, d, max, got > 0 || (flags & MSG_DONTWAIT));
+        if (n == 0)
+            break;
+
+        for (int i = 0; i < n; i++) {
+            uint64 va = vec + got * sizeof(struct mmsghdr);
+            struct mmsghdr mh;
+
+            p[i] = d[i].p;
+            if (err)
+                continue;   // dropped, as Linux drops what it cannot copy
+            if (copyin(pagetable, (char *)&mh, va, sizeof(mh)) < 0 ||
+                (mh.msg_len = dgram_copyout(pagetable, (uint64)mh.msg_buf, mh.msg_len, d[i].p)) < 0) {
+                err = 1;
+                continue;
+            }
+            mh.msg_flags = d[i].p->tot_len > mh.msg_len ? MSG_TRUNC : 0;
+            memset(&mh.msg_name, 0, sizeof(mh.msg_name));
+            mh.msg_name.sa_family = AF_INET;
+            mh.msg_name.sin_port = htons(d[i].port);
+            mh.msg_name.sin_addr = d[i].addr;
+            if (copyout(pagetable, va, (char *)&mh, sizeof(mh)) < 0) {
+                err = 1;
+                continue;
+            }
+            got++;
+        }
+        netfree(p, n);
+    }
+    return got > 0 || !err ? got : -1;
+}
+
+// called from sys_setsockopt() in kernel/sysfile.c
+// https://man7.org/linux/man-pages/man2/setsockopt.2.html
+// only SOL_SOCKET / SO_BUSY_POLL is supported; the time is capped
+// at NETBUSYPOLL so that a reader cannot hog its CPU for long.
+// returns 0 on success, or -1 on error
+int socksetopt(int sockfd, int level, int optname, int optval)
+{
+    struct socket *sock = myproc()->ofile[sockfd]->sock;
+    if (sock == NULL) {
+        printf("socksetopt: invalid socket\n");
+        return -1;
+    }
+
+    if (level != SOL_SOCKET || optname != SO_BUSY_POLL || optval < 0)
+        return -1;
+
+    sock->busy_poll = optval < NETBUSYPOLL ? optval : NETBUSYPOLL;
+    return 0;
+}
+
+
 /* APIS FOR SERVER */
 
 
@@ -575,17 +1070,22 @@ int sockbind(int sockfd, const struct sockaddr *addr, int addrlen)
     LWIP_ASSERT("sockbind: invalid socket state", sock->state == SS_UNCONNECTED);
     LWIP_ASSERT("sockbind: invalid address family", addr->sa_family == AF_INET);
 
-    // bind socket to port
-    ip_addr_t ipaddr = {addr->sin_addr};
-
-    err_t err = tcp_bind(sock->pcb, &ipaddr, addr->sin_port);
+    // bind socket to port. UDP takes it in network byte order, as
+    // connect() does; TCP takes it as given, as it always has
+    struct sockmsg m = {
+        .sock = sock,
+        .addr = {addr->sin_addr},
+        .port = sock->type == SOCK_DGRAM ? ntohs(addr->sin_port) : addr->sin_port,
+    };
+    netcall(do_bind, &m);
+    err_t err = m.err;
 
     if (err == ERR_USE) {
         printf("sockbind: port %d already in use\n", addr->sin_port);
         return -1;
     }
     if (err != ERR_OK) {  // other errors
-        printf("sockbind: tcp_bind failed\n");
+        printf("sockbind: bind failed: %d\n", err);
         return -1;
     }
 
@@ -603,22 +1103,23 @@ int socklisten(int sockfd, int backlog)
         printf("socklisten: invalid socket\n");
         return -1;
     }
+    if (sock->type != SOCK_STREAM)
+        return -1;
 
     LWIP_ASSERT("socklisten: invalid socket state", sock->state == SS_UNCONNECTED);
 
     // listen for incoming connections
     printf("listen: local addr %d\n",sock->pcb->local_ip.addr);
     printf("listen: remote addr %d\n",sock->pcb->remote_ip.addr);
-    struct tcp_pcb *lpcb = tcp_listen_with_backlog(sock->pcb, backlog);
-    if (lpcb == NULL) {
+    // replace the PCB in the socket with the listening PCB
+    struct sockmsg m = { .sock = sock, .n = backlog };
+    netcall(do_listen, &m);
+    if (m.err != ERR_OK) {
         // no memory was available for the listening connection
         printf("socklisten: tcp_listen_with_backlog failed\n");
         return -1;
     }
 
-    // replace the PCB in the socket with the listening PCB
-    // the old PCB is freed by tcp_listen_with_backlog()
-    sock->pcb = lpcb;
     sock->state = SS_LISTENING;
     sock->file->readable = 0;
     sock->file->writable = 0;
@@ -636,12 +1137,15 @@ int sockaccept(int sockfd, struct sockaddr *addr, int *addrlen)
         printf("sockaccept: invalid socket\n");
         return -1;
     }
+    if (sock->type != SOCK_STREAM)
+        return -1;
     LWIP_ASSERT("sockaccept: invalid socket state", sock->state == SS_LISTENING);
 
-    sock_setup_callbacks_accept(sock);
+    struct sockmsg m = { .sock = sock };
+    netcall(do_accept, &m);
 
     // will be woken up by sock_accept() when a connection is established
-    // the new connected PCB is stored in sock->accept_pcb
+    // the peer of the new connection is stored in sock->accept_ip/port
     sem_wait(&sock->lock, &sock->sem);
 
     // check if an incoming connection was accepted
@@ -656,13 +1160,14 @@ int sockaccept(int sockfd, struct sockaddr *addr, int *addrlen)
     // copyout is handled in sys_accept()
     if (addr != NULL && addrlen != NULL) {
         addr->sa_family = sock->domain;                         // always AF_INET
-        addr->sin_port = htons(sock->accept_pcb->remote_port);  // convert to network byte order
-        addr->sin_addr = sock->accept_pcb->remote_ip.addr;      // already in network byte order
+        addr->sin_port = sock->accept_port;     // saved in network byte order
+        addr->sin_addr = sock->accept_ip;       // already in network byte order
         *addrlen = sizeof(struct sockaddr);
     }
 
     // reset temporary fields in the socket
-    sock->accept_pcb = NULL;
+    sock->accept_ip = 0;
+    sock->accept_port = 0;
     sock->accept_fd = -1;
 
     // set socket state from SS_ACCEPTING to SS_LISTENING
@@ -683,15 +1188,12 @@ int sockaccept(int sockfd, struct sockaddr *addr, int *addrlen)
 // returns 0 on success, or -1 on error
 int sockgethostbyname(const char *name, struct sockaddr *addr)
 {
-    // set DNS server address to Google's public DNS server
-    ip_addr_t dns_server = {
-        .addr = DNS_SERVER_IP,
-    };
-    dns_setserver(0, &dns_server);
-
     // resolve hostname
-    ip_addr_t ipaddr = {0};
-    err_t err = dns_gethostbyname(name, &ipaddr, sock_dns_found, &ipaddr);
+    // sock_dns_found() sets m.addr, so m must outlive the wait below
+    struct sockmsg m = { .name = name };
+    netcall(do_dns, &m);
+    ip_addr_t ipaddr = m.addr;
+    err_t err = m.err;
 
     if (err == ERR_OK) {
         // address already cached, addr->sin_addr set to the cached address
@@ -711,6 +1213,7 @@ int sockgethostbyname(const char *name, struct sockaddr *addr)
     // will be woken up by sock_dns_found() when the hostname is resolved
     sem_wait(&dns_sem.lock, &dns_sem.sem);
 
+    ipaddr = m.addr;
     if (ipaddr.addr == 0) {
         printf("sockgethostbyname: failed to resolve hostname %s\n", name);
         return -1;
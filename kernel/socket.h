@@ -18,8 +18,27 @@ typedef enum {
     SS_RECVING,             // receiving data
 } socket_state;
 
-#define SEND_BUFLEN 1024
-#define RECV_BUFLEN 1024
+/* setsockopt() levels and options */
+#define SOL_SOCKET      0xfff   // options for the socket itself
+#define SO_BUSY_POLL    46      // int: microseconds to poll the NIC in a blocked read
+
+#define SEND_BUFLEN 16384     // most bytes one write() sends; fills jumbo TCP segments
+#define RECV_PAGES  16        // pages of a TCP socket's receive ring, allocated while it is open
+#define RECV_BUFLEN (RECV_PAGES * 4096)   // holds a full TCP_WND, see lwipopts.h
+
+/* UDP: datagrams wait in their pbufs until they are read */
+#define SOCK_DGRAMQ 32        // received datagrams a socket holds; more are dropped
+#define UDP_MAXLEN  65481     // largest datagram: pbuf_alloc() adds 54 bytes of header room in 16 bits
+
+struct pbuf;
+struct udp_pcb;
+
+// a received datagram, see sock_udp_recv()
+struct dgram {
+    struct pbuf *p;
+    uint32 addr;            // source address in network byte order
+    uint16 port;            // source port in host byte order
+};
 
 struct socket {
     int domain;                     // address family, always AF_INET
@@ -29,16 +48,21 @@ struct socket {
 
     struct spinlock lock;           // socket lock
     struct tcp_pcb *pcb;
-    struct tcp_pcb *accept_pcb;     // for listening sockets
+    struct udp_pcb *upcb;           // for SOCK_DGRAM sockets, instead of pcb
+    uint32 accept_ip;               // for listening sockets: peer of the accepted
+    uint16 accept_port;             // connection, in network byte order
     int accept_fd;                  // for listening sockets
 
     int sent_len;                   // total number of bytes sent
-    uint8 send_buf[SEND_BUFLEN];    // send buffer
 
     int recv_avail;                 // pointer to the next available byte in recv_buf
     int recv_used;                  // pointer to the next byte to be read from recv_buf
     int eof_reached;                // end of file reached
-    uint8 recv_buf[RECV_BUFLEN];    // receive buffer
+    uint8 *recv_buf[RECV_PAGES];    // receive buffer, one page at a time
+
+    struct dgram dq[SOCK_DGRAMQ];   // received datagrams, protected by socket lock
+    uint dq_head;                   // next datagram to read
+    uint dq_tail;                   // next free slot
 
     struct proc *owner;             // process that owns this socket
 
@@ -47,6 +71,8 @@ struct socket {
 
     int sem;                        // semaphore for async operations, protected by socket lock
     int recv_sem;                   // semaphore for async recv operations, protected by socket lock
+
+    int busy_poll;                  // SO_BUSY_POLL: microseconds to poll before sleeping in read
 };
 
 struct sockaddr
@@ -57,6 +83,19 @@ struct sockaddr
     uint8 sin_zero[8];      // zero this if you want to
 };
 
+/* sendmmsg() and recvmmsg(): many datagrams per system call */
+#define MSG_TRUNC       0x20    // msg_flags: the datagram was longer than msg_len
+#define MSG_DONTWAIT    0x40    // recvmmsg(): return 0 rather than wait
+
+struct mmsghdr {
+    struct sockaddr msg_name;   // sendmmsg(): destination, or sa_family 0 to
+                                // send to the connected peer; recvmmsg(): source
+    void *msg_buf;              // the data
+    int msg_len;                // sendmmsg(): bytes to send; recvmmsg(): room
+                                // in msg_buf, and then bytes received
+    int msg_flags;              // recvmmsg(): MSG_TRUNC or 0
+};
+
 // fixed DNS server address
 #define MAX_DOMAIN_NAME 256
 #define MAX_ADDRESS_LENGTH 256
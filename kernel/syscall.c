@@ -114,6 +114,15 @@ extern uint64 sys_accept(void);
 extern uint64 sys_gethostbyname(void);
 extern uint64 sys_inetaddress(void);
 extern uint64 sys_timenow(void);
+#ifdef BENCH
+extern uint64 sys_ringbench(void);
+extern uint64 sys_csumbench(void);
+#endif
+extern uint64 sys_sendmmsg(void);
+extern uint64 sys_recvmmsg(void);
+extern uint64 sys_netstat(void);
+extern uint64 sys_setsockopt(void);
+extern uint64 sys_capture(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -147,6 +156,15 @@ static uint64 (*syscalls[])(void) = {
 [SYS_gethostbyname] sys_gethostbyname,
 [SYS_inetaddress] sys_inetaddress,
 [SYS_timenow] sys_timenow,
+[SYS_netstat] sys_netstat,
+[SYS_setsockopt] sys_setsockopt,
+[SYS_capture] sys_capture,
+[SYS_sendmmsg] sys_sendmmsg,
+[SYS_recvmmsg] sys_recvmmsg,
+#ifdef BENCH
+[SYS_ringbench] sys_ringbench,
+[SYS_csumbench] sys_csumbench,
+#endif
 };
 
 void
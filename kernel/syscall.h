@@ -31,4 +31,11 @@
 #define SYS_accept          28
 #define SYS_gethostbyname   29
 #define SYS_inetaddress     30
-#define SYS_timenow     31
\ No newline at end of file
+#define SYS_timenow     31
+#define SYS_ringbench   32  // BENCH=1 only
+#define SYS_netstat     33
+#define SYS_setsockopt  34
+#define SYS_capture     35
+#define SYS_csumbench   36  // BENCH=1 only
+#define SYS_sendmmsg    37
+#define SYS_recvmmsg    38
\ No newline at end of file
@@ -16,6 +16,8 @@
 #include "file.h"
 #include "fcntl.h"
 #include "socket.h"
+#include "netstat.h"
+#include "capture.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -632,4 +634,144 @@ sys_inetaddress(void)
 
 
   return rc;
-}
\ No newline at end of file
+}
+#ifdef BENCH
+/*
+input: ring format (0 split, 1 packed), number of frames
+output: time taken to pass them through a virtqueue, in timer ticks
+*/
+uint64
+sys_ringbench(void)
+{
+  int packed, n;
+
+  if(argint(0, &packed) < 0 || argint(1, &n) < 0 || n <= 0)
+    return -1;
+  return virtq_bench(packed, n);
+}
+#endif
+
+#ifdef BENCH
+/*
+input: routine (see csum_bench()), buffer length, repetitions
+output: time taken, in timer ticks
+*/
+uint64
+sys_csumbench(void)
+{
+  int alg, len, n;
+
+  if(argint(0, &alg) < 0 || argint(1, &len) < 0 || argint(2, &n) < 0 || n <= 0)
+    return -1;
+  return csum_bench(alg, len, n);
+}
+#endif
+
+/*
+input: (struct netstat *) buffer in user space
+output: the network statistics, see netstat.h
+*/
+uint64
+sys_netstat(void)
+{
+  uint64 addr;
+  struct netstat *st;
+  int rc = 0;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+
+  // too large for the kernel stack
+  if((st = (struct netstat *)kalloc()) == 0)
+    return -1;
+  netstats(st);
+  if(copyout(myproc()->pagetable, addr, (char *)st, sizeof(*st)) < 0)
+    rc = -1;
+  kfree((char *)st);
+
+  return rc;
+}
+
+/*
+input: socket, level, option, (int *) value in user space, its size
+output: 0 on success, see socksetopt()
+*/
+uint64
+sys_setsockopt(void)
+{
+  int sockfd, level, optname, optlen, optval;
+  uint64 addr;
+  struct file *f;
+
+  if(argfd(0, &sockfd, &f) < 0 || f->type != FD_SOCK || argint(1, &level) < 0 || argint(2, &optname) < 0 ||
+     argaddr(3, &addr) < 0 || argint(4, &optlen) < 0)
+    return -1;
+  if(optlen != sizeof(optval))
+    return -1;
+  if(copyin(myproc()->pagetable, (char *)&optval, addr, sizeof(optval)) < 0)
+    return -1;
+
+  return socksetopt(sockfd, level, optname, optval);
+}
+
+/*
+input: socket, (struct mmsghdr *) datagrams in user space, their
+       number, flags
+output: the number of datagrams sent, see socksendmmsg()
+*/
+uint64
+sys_sendmmsg(void)
+{
+  int sockfd, vlen, flags;
+  uint64 vec;
+  struct file *f;
+
+  if(argfd(0, &sockfd, &f) < 0 || f->type != FD_SOCK || argaddr(1, &vec) < 0 ||
+     argint(2, &vlen) < 0 || argint(3, &flags) < 0)
+    return -1;
+
+  return socksendmmsg(sockfd, vec, vlen, flags);
+}
+
+/*
+input: socket, (struct mmsghdr *) buffers in user space, their
+       number, flags
+output: the number of datagrams received, see sockrecvmmsg()
+*/
+uint64
+sys_recvmmsg(void)
+{
+  int sockfd, vlen, flags;
+  uint64 vec;
+  struct file *f;
+
+  if(argfd(0, &sockfd, &f) < 0 || f->type != FD_SOCK || argaddr(1, &vec) < 0 ||
+     argint(2, &vlen) < 0 || argint(3, &flags) < 0)
+    return -1;
+
+  return sockrecvmmsg(sockfd, vec, vlen, flags);
+}
+
+/*
+input: (struct bpf_insn *) filter in user space, its number of
+       instructions (0 captures every frame, negative stops)
+output: the address of the capture ring, see capture.h
+*/
+uint64
+sys_capture(void)
+{
+  uint64 addr;
+  int n;
+  struct bpf_insn prog[CAPFILTER_MAX];
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(n < 0)
+    return capture_stop(myproc()->pagetable);
+  if(n > CAPFILTER_MAX)
+    return -1;
+  if(copyin(myproc()->pagetable, (char *)prog, addr, n * sizeof(prog[0])) < 0)
+    return -1;
+
+  return capture_start(prog, n);
+}
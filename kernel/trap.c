@@ -168,6 +168,7 @@ clockintr()
   ticks++;
   wakeup(&ticks);
   release(&tickslock);
+  virtio_net_clock();
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -14,7 +14,9 @@
 #define VIRTIO_MMIO_DEVICE_ID           0x008 // device type; 1 is net, 2 is disk
 #define VIRTIO_MMIO_VENDOR_ID           0x00c // 0x554d4551
 #define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014 // 32-bit word of DEVICE_FEATURES, write-only
 #define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024 // 32-bit word of DRIVER_FEATURES, write-only
 #define VIRTIO_MMIO_QUEUE_SEL           0x030 // select queue, write-only
 #define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034 // max size of current queue, read-only
 #define VIRTIO_MMIO_QUEUE_NUM           0x038 // size of current queue, write-only
@@ -25,9 +27,9 @@
 #define VIRTIO_MMIO_STATUS              0x070 // read/write
 #define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080 // physical address for descriptor table, write-only
 #define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
-#define VIRTIO_MMIO_DRIVER_DESC_LOW     0x090 // physical address for available ring, write-only
+#define VIRTIO_MMIO_DRIVER_DESC_LOW     0x090 // physical address for available ring (packed: driver event), write-only
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH    0x094
-#define VIRTIO_MMIO_DEVICE_DESC_LOW     0x0a0 // physical address for used ring, write-only
+#define VIRTIO_MMIO_DEVICE_DESC_LOW     0x0a0 // physical address for used ring (packed: device event), write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH    0x0a4
 #define VIRTIO_MMIO_CONFIG              0x100 // configuration space
 
@@ -45,6 +47,8 @@
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
+#define VIRTIO_F_RING_PACKED        34
 
 #define VIRTIO_NET_F_CSUM                 0
 #define VIRTIO_NET_F_GUEST_CSUM           1
@@ -79,6 +83,7 @@ struct virtq_desc {
 };
 #define VIRTQ_DESC_F_NEXT  1 // chained with another descriptor
 #define VIRTQ_DESC_F_WRITE 2 // device writes (vs read)
+#define VIRTQ_DESC_F_INDIRECT 4 // addr and len describe a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
@@ -100,6 +105,41 @@ struct virtq_used {
   volatile uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[];
 };
+#define VIRTQ_USED_F_NO_NOTIFY 1 // device does not need notifications
+
+// with VIRTIO_RING_F_EVENT_IDX, each ring is followed by one more
+// index (spec 2.6.7 and 2.6.10). used_event: interrupt the driver
+// once used->idx passes it. avail_event: notify the device once
+// avail->idx passes it. num is the size of the queue.
+#define VIRTQ_USED_EVENT(avail, num)  (*(volatile uint16 *)&(avail)->ring[(num)])
+#define VIRTQ_AVAIL_EVENT(used, num)  (*(volatile uint16 *)&(used)->ring[(num)])
+
+// with VIRTIO_F_RING_PACKED, one ring of descriptors takes the
+// place of the descriptor table and both rings. the driver makes a
+// descriptor available by setting AVAIL to its wrap counter and USED
+// to the inverse; the device marks it used by setting both to its
+// own. the wrap counters start at 1 and flip each time the ring
+// index wraps around. spec 2.7
+struct pvirtq_desc {
+  uint64 addr;
+  uint32 len;
+  uint16 id;    // buffer id, returned by the device when it is used
+  volatile uint16 flags;
+};
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED  (1 << 15)
+
+// event suppression, one for each direction. the driver's tells
+// the device when to interrupt, the device's tells the driver when
+// to notify. off_wrap is a ring offset in bits 0-14 and the wrap
+// counter in bit 15, used with EVENT_IDX. spec 2.7.14
+struct pvirtq_event {
+  volatile uint16 off_wrap;
+  volatile uint16 flags;
+};
+#define RING_EVENT_FLAGS_ENABLE  0x0
+#define RING_EVENT_FLAGS_DISABLE 0x1
+#define RING_EVENT_FLAGS_DESC    0x2 // only with VIRTIO_RING_F_EVENT_IDX
 
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
@@ -128,6 +168,29 @@ struct virtio_net_config {
   uint16 mtu;                   // only exists if VIRTIO_NET_F_MTU is set
 };
 
+// header of a command on the control queue
+// spec 5.1.6.5 Control Virtqueue
+struct virtio_net_ctrl_hdr {
+  uint8 class;
+  uint8 command;
+};
+
+#define VIRTIO_NET_OK     0
+#define VIRTIO_NET_ERR    1
+
+#define VIRTIO_NET_CTRL_RX                0
+#define VIRTIO_NET_CTRL_RX_PROMISC        0   // data: uint8 on/off
+#define VIRTIO_NET_CTRL_RX_ALLMULTI       1   // data: uint8 on/off
+
+#define VIRTIO_NET_CTRL_MAC               1
+#define VIRTIO_NET_CTRL_MAC_TABLE_SET     0   // data: unicast, then multicast table
+#define VIRTIO_NET_CTRL_MAC_ADDR_SET      1   // data: uint8 mac[6]
+
+#define VIRTIO_NET_CTRL_MQ                4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET   0   // data: uint16 virtqueue_pairs
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN   1
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX   0x8000
+
 // header for each packet
 // spec 5.1.6 Device Operation
 struct virtio_net_hdr {
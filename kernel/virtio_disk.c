@@ -15,6 +15,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "virtq.h"
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
@@ -24,32 +25,25 @@
 #define NUM 8
 
 struct disk {
-  // The descriptor table tells the device where to read and write
-  // individual disk operations.
-  struct virtq_desc *desc;
-  // The available ring is where the driver writes descriptor numbers
-  // that the driver would like the device to process (just the head
-  // of each chain). The ring has NUM elements.
-  struct virtq_avail *avail;
-  // The used ring is where the device writes descriptor numbers that
-  // the device has finished processing (just the head of each chain).
-  // The ring has NUM elements.
-  struct virtq_used *used;
+  // the request queue. see virtq.c.
+  struct virtqueue vq;
 
   // our own book-keeping.
-  char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used->ring.
+  // requests are named by buffer ids below nreq. a request takes
+  // three descriptors, or with VIRTIO_RING_F_INDIRECT_DESC just one.
+  char free[NUM];  // is a request id free?
+  int nreq;        // requests in flight, at most
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // indexed by request id.
   struct {
     struct buf *b;
     char status;
   } info[NUM];
 
   // disk command headers.
-  // one-for-one with descriptors, for convenience.
+  // one-for-one with request ids, for convenience.
   struct virtio_blk_req ops[NUM];
   
   struct spinlock vdisk_lock;
@@ -63,15 +57,6 @@ virtio_disk_init(void)
 
   initlock(&disk.vdisk_lock, "virtio_disk");
 
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 2 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -98,7 +83,8 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // keep VIRTIO_RING_F_INDIRECT_DESC if offered: a request then
+  // takes one ring slot instead of three.
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // Tell device that feature negotiation is complete.
@@ -111,28 +97,11 @@ virtio_disk_init(void)
     panic("virtio disk FEATURES_OK unset");
 
   // Initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk ready not zero");
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW)   = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH)  = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW)  = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW)  = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  /* Queue ready. */
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  virtq_init(&disk.vq, VIRTIO0, 0, NUM, NUM, features, 3);
+
+  // all requests start out unused.
+  disk.nreq = disk.vq.indirect ? NUM : NUM / 3;
+  for(int i = 0; i < disk.nreq; i++)
     disk.free[i] = 1;
 
   // Tell device we're completely ready.
@@ -142,11 +111,11 @@ virtio_disk_init(void)
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
-// find a free descriptor, mark it non-free, return its index.
+// find a free request id, mark it non-free, return it.
 static int
-alloc_desc(void)
+alloc_id(void)
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.nreq; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
       return i;
@@ -155,46 +124,18 @@ alloc_desc(void)
   return -1;
 }
 
-// mark a descriptor as free.
+// mark a request id as free.
 static void
-free_desc(int i)
+free_id(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.nreq)
     panic("virtio_disk_intr 1");
   if(disk.free[i])
     panic("virtio_disk_intr 2");
-  disk.desc[i].addr = 0;
   disk.free[i] = 1;
   wakeup(&disk.free[0]);
 }
 
-// free a chain of descriptors.
-static void
-free_chain(int i)
-{
-  while(1){
-    free_desc(i);
-    if(disk.desc[i].flags & VIRTQ_DESC_F_NEXT)
-      i = disk.desc[i].next;
-    else
-      break;
-  }
-}
-
-static int
-alloc3_desc(int *idx)
-{
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
-    }
-  }
-  return 0;
-}
-
 void
 virtio_disk_rw(struct buf *b, int write)
 {
@@ -205,20 +146,19 @@ virtio_disk_rw(struct buf *b, int write)
   // the spec says that legacy block operations use three
   // descriptors: one for type/reserved/sector, one for
   // the data, one for a 1-byte status result.
+  // with indirect descriptors they go in the request's own
+  // table, see virtq_add().
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
+  // allocate a request id. its descriptors are free as well,
+  // since nreq requests fit in the ring.
+  int id;
+  while((id = alloc_id()) < 0)
     sleep(&disk.free[0], &disk.vdisk_lock);
-  }
   
-  // format the three descriptors.
+  // format the three segments.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &disk.ops[id];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -227,46 +167,31 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VIRTQ_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VIRTQ_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VIRTQ_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  disk.info[id].status = 0;
 
-  disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VIRTQ_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  struct virtq_seg seg[3] = {
+    { (uint64) buf0, sizeof(struct virtio_blk_req), 0 },
+    // device reads or writes b->data
+    { (uint64) b->data, BSIZE, !write },
+    // device writes the status
+    { (uint64) &disk.info[id].status, 1, 1 },
+  };
 
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
-  disk.info[idx[0]].b = b;
-
-  // avail->idx tells the device how far to look in avail->ring.
-  // avail->ring[...] are desc[] indices the device should process.
-  // we only tell device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
-  __sync_synchronize();
-  disk.avail->idx += 1;
+  disk.info[id].b = b;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  if(virtq_add(&disk.vq, seg, 3, id) < 0)
+    panic("virtio_disk_rw");
+  virtq_kick(&disk.vq);
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  disk.info[id].b = 0;
+  free_id(id);
 
   release(&disk.vdisk_lock);
 }
@@ -276,16 +201,13 @@ virtio_disk_intr(void)
 {
   acquire(&disk.vdisk_lock);
 
-  while((disk.used_idx % NUM) != (disk.used->idx % NUM)){
-    int id = disk.used->ring[disk.used_idx].id;
-
+  int id, len;
+  while(virtq_get(&disk.vq, &id, &len) == 0){
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
     
     disk.info[id].b->disk = 0;   // disk is done with buf
     wakeup(disk.info[id].b);
-
-    disk.used_idx = (disk.used_idx + 1) % NUM;
   }
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
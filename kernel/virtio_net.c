@@ -1,132 +1,203 @@
 #include "types.h"
 #include "riscv.h"
 #include "defs.h"
+#include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "virtio.h"
+#include "virtq.h"
+#include "netstat.h"
+#include "pagepool.h"
+#include "lwip/pbuf.h"
+#include "lwip/prot/ip.h"
+#include "lwip/inet_chksum.h"
 
 #define R(r) ((volatile uint32 *)(VIRTIO1 + (r)))
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 32
-
-struct virtqueue {
-    // The descriptor table tells the device where to read and write
-    // individual operations.
-    struct virtq_desc *desc;
-    // The available ring is where the driver writes descriptor numbers
-    // that the driver would like the device to process (just the head
-    // of each chain). The ring has NUM elements.
-    struct virtq_avail *avail;
-    // The used ring is where the device writes descriptor numbers that
-    // the device has finished processing (just the head of each chain).
-    // The ring has NUM elements.
-    struct virtq_used *used;
-
-    // our own book-keeping.
-    char free[2*NUM];   // is a descriptor free?
-    uint16 used_idx;    // we've looked this far in used->ring.
-
-    // packet headers
-    // one-for-one with descriptors, for convenience.
-    struct virtio_net_hdr ops[NUM];
-};
+// queues are sized at init: NETRXRING and NETTXRING descriptors
+// (param.h), or as many as the device allows, rounded down to a
+// power of two. the receive and transmit queues need at least
+// RING_MIN descriptors, the control queue needs CTRL_RING.
+// the rings themselves are in virtq.c.
+#define RING_MIN 64
+#define CTRL_RING 8
+
+// allocate and zero n bytes of physically contiguous memory,
+// in whole pages. the rings and buffer arrays of a large queue
+// take more than one page.
+static void *
+net_alloc(uint64 n)
+{
+    int npages = (n + PGSIZE - 1) / PGSIZE;
+    void *p = npages == 1 ? kalloc() : kallocn(npages);
+    if (p == 0)
+        panic("virtio_net: out of memory");
+    memset(p, 0, npages * PGSIZE);
+    return p;
+}
 
-void mmio_virtq_init(struct virtqueue *q, int qidx) {
-    /* 
-     * MMIO-specific initialization
-     * check spec 4.2.3.2 Virtqueue Configuration
-     */
-    
-    // 1. select a queue by writing to queuesel
-    *R(VIRTIO_MMIO_QUEUE_SEL) = qidx;
-    
-    // 2. check if the queue is already in use
-    if(*R(VIRTIO_MMIO_QUEUE_READY))
-        panic("virtq_init: queue already in use");
-    
-    // 3. check if the queue is available (queue-num-max != 0)
-    uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-    if(max == 0) panic("virtq_init: queue not available");
-    if(max < NUM) panic("virtq_init: queue too short");
-
-    // 4. allocate and zero the queue memory
-    q->desc = (struct virtq_desc *)kalloc();
-    q->avail = (struct virtq_avail *)kalloc();
-    q->used = (struct virtq_used *)kalloc();
-    
-    if (!q->desc || !q->avail || !q->used)
-        panic("virtq_init: kalloc failed");
 
-    memset(q->desc, 0, PGSIZE);
-    memset(q->avail, 0, PGSIZE);
-    memset(q->used, 0, PGSIZE);
+// at most this many data descriptors per frame. longer pbuf
+// chains are copied into send_buf[] and sent as one segment.
+#define TX_MAX_SEGS 8
 
-    // 5. notify the device about the queue size
-    *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-    if (qidx == 0) // RX queue
-        *R(VIRTIO_MMIO_QUEUE_NUM) = 2*NUM;
+// frames that find the TX ring full wait in a software backlog
+// of this many entries, which is drained as the device completes
+// earlier frames. must be a power of two.
+#define TX_BACKLOG 64
 
-    // 6. write PA of three parts of the queue to the device
-    *R(VIRTIO_MMIO_QUEUE_DESC_LOW)   = (uint64)q->desc;
-    *R(VIRTIO_MMIO_QUEUE_DESC_HIGH)  = (uint64)q->desc >> 32;
-    *R(VIRTIO_MMIO_DRIVER_DESC_LOW)  = (uint64)q->avail;
-    *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
-    *R(VIRTIO_MMIO_DEVICE_DESC_LOW)  = (uint64)q->used;
-    *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+// largest IP packet on the wire, unless the device tells us
+// otherwise with VIRTIO_NET_F_MTU.
+#define ETH_MTU 1500
 
-    // 7. tell the device that the queue is ready
-    *R(VIRTIO_MMIO_QUEUE_READY) = 1;
+// a receive buffer lent to lwIP without copying, at the end of
+// its page; the device writes the first RX_BUFLEN bytes. when
+// pbuf_free() drops the last reference, lwIP calls rx_pbuf_free(),
+// which gives the page back to the page pool.
+struct rx_pbuf {
+    struct pbuf_custom pc;  // must be first
+};
 
+#define RX_BUFLEN (PGSIZE - ((sizeof(struct rx_pbuf) + 63) & ~63))
 
-    /* 
-     * initialize book-keeping 
-     */
-    for(int i = 0; i < 2*NUM; i++)
-        q->free[i] = 1;
-    q->used_idx = 0;
-}
+// the most buffers the device may merge into one packet,
+// 64 KB with VIRTIO_NET_F_GUEST_TSO4.
+#define RX_MAXBUFS (65550 / RX_BUFLEN + 1)
 
-struct net {
+// one receiveq/transmitq pair, with its own buffers and lock.
+// with VIRTIO_NET_F_MQ each CPU transmits on its own pair, and the
+// device spreads received packets over the pairs. spec 5.1.2
+struct netq {
     struct virtqueue rx;
     struct virtqueue tx;
-    void  *send_buf[NUM];
-    void  *recv_buf[NUM];
-    struct spinlock vnet_lock;
-} net;
+    // one page per descriptor; arrays of rx.num and tx.num entries.
+    void  **send_buf;
+    // the page from net.pool posted as each RX buffer id.
+    void  **rx_page;
+    // pbufs in flight, indexed by buffer id.
+    struct pbuf **tx_pbuf;
+    // free TX buffer ids, a stack of tx.num entries.
+    uint16 *tx_id;
+    int tx_nid;
+    // packet headers of the TX queue
+    // one-for-one with buffer ids, for convenience.
+    struct virtio_net_hdr *tx_ops;
+    // pbufs whose transmission has completed; they are freed by
+    // tx_free(), in lwIP context and without the lock.
+    struct pbuf **tx_done;
+    int tx_ndone;
+    // frames waiting for free TX descriptors. the queue is stopped,
+    // and new frames join the backlog, until it has been drained.
+    struct pbuf *tx_backlog[TX_BACKLOG];
+    uint tx_bl_head;        // next frame to post
+    uint tx_bl_tail;        // next free backlog slot
+    int batch;              // nesting depth of virtio_net_batch_begin()
+    int tx_posted;          // frames posted since the last tx_kick()
+    struct netqstat st;     // counters, see netstat.h
+    struct spinlock lock;
+};
 
-static void 
-fill_rx(int i) {
-    struct virtio_net_hdr *hdr = &net.rx.ops[i];
+// a command on the control queue. spec 5.1.6.5
+// multicast addresses the device filter can hold. more groups
+// than this and the device passes all multicast traffic.
+#define MAC_TABLE 16
+
+struct virtio_net_ctrl {
+    struct virtio_net_ctrl_hdr hdr;     // device reads
+    uint8 data[8 + 6*MAC_TABLE];        // device reads
+    uint8 ack;                          // device writes
+};
+
+// a multicast address lwIP listens on, see virtio_net_filter().
+struct mcast {
+    uint8 mac[6];
+    int ref;                // groups that map to this address
+};
 
-    // header is populated by the device
-    // we don't fill it here
+struct net {
+    struct netq q[NCPU];
+    int npairs;             // queue pairs in use
+    int rx_next;            // pair virtio_net_recv() looks at first
+    struct virtqueue ctrl;  // control queue, if VIRTIO_NET_F_CTRL_VQ
+    struct virtio_net_ctrl cmd;
+    struct spinlock ctrl_lock;
+    struct mcast mc[MAC_TABLE];
+    int nmc;
+    int mc_overflow;        // references to addresses that did not fit
+    int mtu;                // largest IP packet we send and expect
+    uint64 features;        // negotiated feature bits
+    // pages of all RX rings, and those lent to lwIP. a received
+    // page goes to lwIP, and a fresh one from the pool takes its
+    // place in the ring.
+    struct pagepool pool;
+    // set by virtio_net_intr() when a queue needs the network thread.
+    int wake;
+    uint64 deadline;        // r_mtime() when virtio_net_wait() returns anyway, or 0
+    uint64 intrs;           // counters, see netstat.h
+    uint64 wakeups;
+    struct spinlock wait_lock;
+} net;
 
-    net.rx.desc[2*i].addr = (uint64)hdr;
-    net.rx.desc[2*i].len = sizeof(struct virtio_net_hdr);
-    net.rx.desc[2*i].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
-    net.rx.desc[2*i].next = 2*i+1;
+static int ctrl_cmd(int, int, void *, int);
+static int mac_table_set(void);
 
-    net.rx.desc[2*i+1].addr = (uint64)net.recv_buf[i];
-    net.rx.desc[2*i+1].len = PGSIZE;
-    net.rx.desc[2*i+1].flags = VIRTQ_DESC_F_WRITE;  // device writes to this buffer
-    net.rx.desc[2*i+1].next = 0;                    // VIRTQ_DESC_F_NEXT not set: no chaining
+// post the page rx_page[i] as buffer id i.
+// with VIRTIO_NET_F_MRG_RXBUF the device writes the header at the
+// start of the first buffer of a packet, and continues the data in
+// as many further buffers as it needs. spec 5.1.6.3.1
+static void 
+fill_rx(struct netq *nq, int i) {
+    struct virtq_seg seg = {
+        .addr = (uint64)nq->rx_page[i],
+        .len = RX_BUFLEN,
+        .write = 1,             // device writes to this buffer
+    };
+
+    // the device is notified by the caller, once per batch
+    if (virtq_add(&nq->rx, &seg, 1, i) < 0)
+        panic("fill_rx");
+}
 
-    net.rx.avail->ring[net.rx.avail->idx % (2 * NUM)] = 2*i;
-    __sync_synchronize();
-    net.rx.avail->idx++;
+// the netstat.h histogram bucket of a batch of n.
+static int
+hist_bucket(int n)
+{
+    int b = 0;
+    while (n > 0 && b < NETSTAT_HIST - 1) {
+        n >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// notify the device about frames posted to the TX queue.
+// caller holds nq->lock.
+static void
+tx_kick(struct netq *nq)
+{
+    if (nq->tx_posted > 0) {
+        nq->st.tx_batch[hist_bucket(nq->tx_posted)]++;
+        nq->tx_posted = 0;
+    }
+    nq->st.tx_kicks += virtq_kick(&nq->tx);
+}
 
-    // notify the device
-    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;  // queue number of RX
+// notify the device about buffers posted to the RX queue.
+// caller holds nq->lock.
+static void
+rx_kick(struct netq *nq)
+{
+    nq->st.rx_kicks += virtq_kick(&nq->rx);
 }
 
 /* initialize the NIC and store the MAC address */
 void virtio_net_init(void *mac) {
     uint32 status = 0;
 
-    initlock(&net.vnet_lock, "virtio_net");
+    initlock(&net.ctrl_lock, "virtio_net_ctrl");
+    initlock(&net.wait_lock, "virtio_net_wait");
 
     /*
      * MMIO-specific checking.
@@ -157,39 +228,82 @@ void virtio_net_init(void *mac) {
 
     // Negotiate features.
     // spec 5.1.3 Feature bits
-    uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+    // the register shows 32 bits at a time; bits 32 and up are
+    // reserved for features of the transport and the rings. spec 6
+    *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+    uint64 features = (uint64)*R(VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+    *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
+    features |= *R(VIRTIO_MMIO_DEVICE_FEATURES);
     if (!(features & (1 << VIRTIO_NET_F_MAC)) || 
         !(features & (1 << VIRTIO_NET_F_MRG_RXBUF)))
             panic("virtio_net_init: device does not support MAC or MRG_RXBUF");
 
-    // !! disable VIRTIO_NET_F_CSUM (0) 
-    // Device (not driver) handles packets with partial checksum. 
-    // If not negotiated, the driver SHOULD supply a fully checksummed packet to the device.
-    features &= ~(1 << VIRTIO_NET_F_CSUM);
-
-    // !! disable VIRTIO_NET_F_GUEST_CSUM (1)
-    // If not negotiated, the device SHOULD supply a fully checksummed packet to the driver.
-    features &= ~(1 << VIRTIO_NET_F_GUEST_CSUM);
-
-    features &= ~(1 << VIRTIO_NET_F_GUEST_TSO4);
+    // keep VIRTIO_NET_F_CSUM (0) if offered:
+    // the device completes TCP/UDP checksums of packets marked
+    // VIRTIO_NET_HDR_F_NEEDS_CSUM, see tx_csum().
+    // keep VIRTIO_NET_F_GUEST_CSUM (1) if offered:
+    // the device may mark received packets VIRTIO_NET_HDR_F_DATA_VALID
+    // or deliver them with a partial checksum, see rx_csum_ok().
+    // net.c turns lwIP's own checksumming off for what we negotiated.
+
+    // keep VIRTIO_NET_F_GUEST_TSO4 (7) if offered along with
+    // GUEST_CSUM, which it depends on, and VIRTIO_NET_F_GUEST_ECN (9)
+    // with it: the device may merge TCP segments into packets of up
+    // to 64 KB, spread over several receive buffers, see rx_one().
+    if (!(features & (1 << VIRTIO_NET_F_GUEST_CSUM)))
+        features &= ~(1 << VIRTIO_NET_F_GUEST_TSO4);
+    if (!(features & (1 << VIRTIO_NET_F_GUEST_TSO4)))
+        features &= ~(1 << VIRTIO_NET_F_GUEST_ECN);
     features &= ~(1 << VIRTIO_NET_F_GUEST_TSO6);
-    features &= ~(1 << VIRTIO_NET_F_GUEST_ECN);
     features &= ~(1 << VIRTIO_NET_F_GUEST_UFO);
     
-    features &= ~(1 << VIRTIO_NET_F_HOST_TSO4);
+    // keep VIRTIO_NET_F_HOST_TSO4 (11) if offered along with CSUM,
+    // which it depends on: lwIP passes TCP segments of up to 64 KB,
+    // which the device cuts into MTU-sized frames, see tx_gso().
+    if (!(features & (1 << VIRTIO_NET_F_CSUM)))
+        features &= ~(1 << VIRTIO_NET_F_HOST_TSO4);
     features &= ~(1 << VIRTIO_NET_F_HOST_TSO6);
     features &= ~(1 << VIRTIO_NET_F_HOST_ECN);
     features &= ~(1 << VIRTIO_NET_F_HOST_UFO);
     
     features &= ~(1L << VIRTIO_NET_F_RSC_EXT);
 
-    features &= ~(1 << VIRTIO_NET_F_CTRL_VQ);
-    features &= ~(1 << VIRTIO_NET_F_CTRL_RX);
-    features &= ~(1 << VIRTIO_NET_F_CTRL_VLAN);
-
-    features &= ~(1 << VIRTIO_NET_F_MQ);
+    // keep VIRTIO_NET_F_MTU (3) if offered: the device reports the
+    // largest MTU it supports, and we use up to NETMTU (param.h) of
+    // it. received jumbo frames are merged from several buffers.
+
+    // keep VIRTIO_NET_F_CTRL_VQ (17) if offered: commands go to the
+    // device through the control queue, see ctrl_cmd().
+    // keep VIRTIO_NET_F_CTRL_RX (18) along with it: the device drops
+    // multicast traffic lwIP has not asked for, see virtio_net_filter().
+    // keep VIRTIO_NET_F_CTRL_VLAN (19): with an empty VLAN filter the
+    // device drops all VLAN tagged frames, which we have no use for.
+    // keep VIRTIO_NET_F_MQ (22): each CPU gets its own queue pair, up
+    // to max_virtqueue_pairs.
+    if (!(features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+        features &= ~(1 << VIRTIO_NET_F_CTRL_RX);
+        features &= ~(1 << VIRTIO_NET_F_CTRL_VLAN);
+        features &= ~(1 << VIRTIO_NET_F_MQ);
+    }
 
+    // keep VIRTIO_RING_F_EVENT_IDX if offered: both sides then
+    // suppress notifications and interrupts they do not need.
+    // keep VIRTIO_RING_F_INDIRECT_DESC if offered: a frame or a
+    // command takes one ring slot however many segments it has.
+
+    // keep VIRTIO_F_VERSION_1 (32): we follow the virtio 1 layout.
+    // keep VIRTIO_F_RING_PACKED (34) if NETPACKED asks for it:
+    // all queues use the packed layout, see virtq.h.
+    // clear the other transport features we do not know.
+    if (!NETPACKED)
+        features &= ~(1L << VIRTIO_F_RING_PACKED);
+    features &= ((1L << 32) - 1) | (1L << VIRTIO_F_VERSION_1) | (1L << VIRTIO_F_RING_PACKED);
+
+    *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+    *R(VIRTIO_MMIO_DRIVER_FEATURES) = features >> 32;
+    *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
     *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+    net.features = features;
 
     // Tell device that feature negotiation is complete.
     status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -207,30 +321,60 @@ void virtio_net_init(void *mac) {
     
     // 1. identify and initialize the virtqueues
     // queue idx: spec 5.1.2 Virtqueues
-    mmio_virtq_init(&net.rx, 0);
-    mmio_virtq_init(&net.tx, 1);
-    
-    for (int i = 0; i < NUM; i++) {
-        net.send_buf[i] = kalloc();
-        if (!net.send_buf[i])
-            panic("virtio_net_init: kalloc failed");
-        memset(net.send_buf[i], 0, PGSIZE);
-
-        net.recv_buf[i] = kalloc();
-        if (!net.recv_buf[i])
-            panic("virtio_net_init: kalloc failed");
-        memset(net.recv_buf[i], 0, PGSIZE);
+    // receiveqN is 2(N-1), transmitqN is 2(N-1)+1, and the control
+    // queue follows the last pair the device supports.
+    struct virtio_net_config *cfg = (struct virtio_net_config *)R(VIRTIO_MMIO_CONFIG);
+    int max_pairs = 1;
+    if (features & (1 << VIRTIO_NET_F_MQ))
+        max_pairs = cfg->max_virtqueue_pairs;
+    net.npairs = max_pairs < NCPU ? max_pairs : NCPU;
+    pp_init(&net.pool, net.npairs * NETRXRING + NETRXPOOL);
+
+    for (int k = 0; k < net.npairs; k++) {
+        struct netq *nq = &net.q[k];
+        initlock(&nq->lock, "virtio_net");
+        virtq_init(&nq->rx, VIRTIO1, 2*k, NETRXRING, RING_MIN, features, 1);
+        virtq_init(&nq->tx, VIRTIO1, 2*k + 1, NETTXRING, RING_MIN, features, 1 + TX_MAX_SEGS);
+
+        nq->send_buf = net_alloc(nq->tx.num * sizeof(void *));
+        nq->tx_pbuf = net_alloc(nq->tx.num * sizeof(struct pbuf *));
+        nq->tx_done = net_alloc(nq->tx.num * sizeof(struct pbuf *));
+        nq->tx_id = net_alloc(nq->tx.num * sizeof(uint16));
+        nq->tx_ops = net_alloc(nq->tx.num * sizeof(struct virtio_net_hdr));
+        for (int i = 0; i < nq->tx.num; i++) {
+            nq->send_buf[i] = net_alloc(PGSIZE);
+            nq->tx_id[nq->tx_nid++] = i;
+        }
+
+        nq->rx_page = net_alloc(nq->rx.num * sizeof(void *));
+        pp_grow(&net.pool, nq->rx.num);
+        for (int i = 0; i < nq->rx.num; i++)
+            nq->rx_page[i] = pp_get(&net.pool);
+
+        // 2. fill receive queue with buffers
+        // 5.1.6.3 Setting Up Receive Buffers
+        // 2.6.5 The Virtqueue Descriptor Table
+        for (int i = 0; i < nq->rx.num; i++)
+            fill_rx(nq, i);
+        virtq_enable_intr(&nq->rx, 0);
+        rx_kick(nq);
+    }
+    // spare pages, which rx_one() swaps into the rings
+    pp_grow(&net.pool, NETRXPOOL);
+
+    if (features & (1 << VIRTIO_NET_F_CTRL_VQ))
+        virtq_init(&net.ctrl, VIRTIO1, 2*max_pairs, CTRL_RING, CTRL_RING, features, 3);
+
+    // the MTU, at least the minimum of IPv4. spec 5.1.4.1
+    net.mtu = ETH_MTU;
+    if ((features >> VIRTIO_NET_F_MTU) & 1) {
+        net.mtu = cfg->mtu < NETMTU ? cfg->mtu : NETMTU;
+        if (net.mtu < 68)
+            net.mtu = 68;
     }
-
-    // 2. fill receive queue with buffers
-    // 5.1.6.3 Setting Up Receive Buffers
-    // 2.6.5 The Virtqueue Descriptor Table
-    for (int i = 0; i < NUM; i++)
-        fill_rx(i);
 
     // 3. read and store the MAC address
     // spec 2.4.1 Driver Requirements: Device Configuration Space
-    struct virtio_net_config *cfg = (struct virtio_net_config *)R(VIRTIO_MMIO_CONFIG);
     uint8 before, after;
     for (int i = 0; i < 6; i++) {
         do {
@@ -243,68 +387,310 @@ void virtio_net_init(void *mac) {
     // Tell device we're completely ready.
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     *R(VIRTIO_MMIO_STATUS) = status;
+
+    // 4. the device uses only the first pair until told otherwise.
+    // spec 5.1.6.5.5 Automatic receive steering in multiqueue mode
+    if (net.npairs > 1) {
+        uint16 pairs = net.npairs;
+        if (ctrl_cmd(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                     &pairs, sizeof(pairs)) < 0) {
+            printf("virtio_net_init: cannot enable %d queue pairs\n", net.npairs);
+            net.npairs = 1;
+        }
+    }
+
+    // 5. receive filtering: the device starts out promiscuous. from
+    // now on it passes our own address, broadcasts, and the multicast
+    // addresses in its table. spec 5.1.6.5.1
+    if ((features >> VIRTIO_NET_F_CTRL_RX) & 1) {
+        uint8 off = 0;
+        if (ctrl_cmd(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &off, 1) < 0 ||
+            ctrl_cmd(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &off, 1) < 0 ||
+            mac_table_set() < 0)
+            printf("virtio_net_init: cannot set receive filter\n");
+    }
 }
 
-// find a free descriptor, mark it non-free, return its index.
-static int
-alloc_desc(struct virtqueue *q)
+// the feature bits negotiated with the device.
+uint64
+virtio_net_features(void)
 {
-  for(int i = 0; i < NUM; i++){
-    if(q->free[i]){
-        q->free[i] = 0;
-        return i;
-    }
-  }
-  return -1;
+    return net.features;
 }
 
-// mark a descriptor as free.
-static void
-free_desc(struct virtqueue *q, int i)
+// the MTU to configure lwIP with.
+int
+virtio_net_mtu(void)
 {
-  if(i >= NUM)
-    panic("free_desc: out of range");
-  if(q->free[i])
-    panic("free_desc: double free");
-  q->desc[i].addr = 0;
-  q->free[i] = 1;
+    return net.mtu;
 }
 
-/* send data; return 0 on success */
-// spec 5.1.6.2 Packet Transmission
-int virtio_net_send(const void *data, int len) {
-    acquire(&net.vnet_lock);
-
-    // if the available ring is full, drop the packet
-    // avail->idx and used->idx are only increased (no modulo)
-    if (net.tx.avail->idx - net.tx.used->idx == NUM) {
-        printf("virtio_net_send: ring full\n");
-        release(&net.vnet_lock);
+// send a command on the control queue and wait for the device
+// to acknowledge it. returns 0 on VIRTIO_NET_OK, -1 otherwise.
+// spec 5.1.6.5 Control Virtqueue
+static int
+ctrl_cmd(int class, int command, void *data, int len)
+{
+    struct virtqueue *q = &net.ctrl;
+    int id, n;
+
+    if (!((net.features >> VIRTIO_NET_F_CTRL_VQ) & 1) || len > sizeof(net.cmd.data))
         return -1;
+
+    acquire(&net.ctrl_lock);
+
+    net.cmd.hdr.class = class;
+    net.cmd.hdr.command = command;
+    memmove(net.cmd.data, data, len);
+    net.cmd.ack = VIRTIO_NET_ERR;
+
+    struct virtq_seg seg[3] = {
+        { (uint64)&net.cmd.hdr, sizeof(net.cmd.hdr), 0 },
+        { (uint64)net.cmd.data, len, 0 },
+        { (uint64)&net.cmd.ack, sizeof(net.cmd.ack), 1 },
+    };
+    if (virtq_add(q, seg, 3, 0) < 0)
+        panic("ctrl_cmd: descriptors");
+    virtq_kick(q);
+
+    // the device handles commands right away
+    while (virtq_get(q, &id, &n) < 0)
+        ;
+    int ok = net.cmd.ack == VIRTIO_NET_OK;
+
+    release(&net.ctrl_lock);
+    return ok ? 0 : -1;
+}
+
+// load the device's MAC filter: no extra unicast addresses, and
+// the multicast addresses in net.mc[]. spec 5.1.6.5.2
+static int
+mac_table_set(void)
+{
+    uint8 buf[sizeof(net.cmd.data)];
+    uint32 n = 0;
+
+    memmove(buf, &n, 4);                // unicast entries (le32)
+    n = net.nmc;
+    memmove(buf + 4, &n, 4);            // multicast entries (le32)
+    for (int i = 0; i < net.nmc; i++)
+        memmove(buf + 8 + 6*i, net.mc[i].mac, 6);
+    return ctrl_cmd(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET, buf, 8 + 6*net.nmc);
+}
+
+// let the device pass (add) or drop (!add) frames sent to the
+// multicast address mac. called for lwIP's igmp_mac_filter, in
+// lwIP context. an address may be added more than once. if the
+// table is full the device passes all multicast traffic instead.
+// returns 0, or -1 if the device refused the change.
+int
+virtio_net_filter(uint8 *mac, int add)
+{
+    int i, allmulti;
+    uint8 on;
+
+    if (!((net.features >> VIRTIO_NET_F_CTRL_RX) & 1))
+        return 0;   // the device does not filter
+
+    for (i = 0; i < net.nmc; i++)
+        if (memcmp(net.mc[i].mac, mac, 6) == 0)
+            break;
+
+    allmulti = net.mc_overflow > 0;
+    if (add) {
+        if (i < net.nmc) {
+            net.mc[i].ref++;
+            return 0;
+        }
+        if (net.nmc == MAC_TABLE) {
+            net.mc_overflow++;
+        } else {
+            memmove(net.mc[net.nmc].mac, mac, 6);
+            net.mc[net.nmc++].ref = 1;
+        }
+    } else {
+        if (i == net.nmc) {
+            if (net.mc_overflow > 0)
+                net.mc_overflow--;
+        } else if (--net.mc[i].ref > 0) {
+            return 0;
+        } else {
+            net.mc[i] = net.mc[--net.nmc];
+        }
     }
 
-    // first free all used descriptors
-    while (net.tx.used->idx > net.tx.used_idx) {
-        struct virtq_used_elem *e = &net.tx.used->ring[net.tx.used_idx % NUM];
-        free_desc(&net.tx, e->id);
-        net.tx.used_idx++;
+    if (allmulti != (net.mc_overflow > 0)) {
+        on = net.mc_overflow > 0;
+        if (ctrl_cmd(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &on, 1) < 0)
+            return -1;
     }
+    return mac_table_set();
+}
 
-    // allocate one descriptor for header + data
-    int idx = 0;
-    if ((idx = alloc_desc(&net.tx)) < 0) {
-        printf("virtio_net_send: no available descriptor\n");
-        printf("virtio_net_send: avail->idx = %d, used->idx = %d, used_idx = %d\n", net.tx.avail->idx, net.tx.used->idx, net.tx.used_idx);
-        release(&net.vnet_lock);
+// find the transport header of an IPv4 TCP or UDP packet that is
+// not an IP fragment. frame holds the first hlen bytes of a frame
+// of len bytes. returns the protocol and sets *l4 to the offset and
+// *l4len to the length of the transport segment. returns 0 for any
+// other packet, or -1 if the headers are not all within hlen.
+static int
+csum_parse(uint8 *frame, int hlen, int len, int *l4, int *l4len)
+{
+    if (len < 14 + 20)
+        return 0;
+    if (hlen < 14 + 20)
         return -1;
-    }
+    if (frame[12] != 0x08 || frame[13] != 0x00)     // ethertype IPv4
+        return 0;
+
+    uint8 *ip = frame + 14;
+    int ihl = (ip[0] & 0xf) * 4;
+    int totlen = ip[2] << 8 | ip[3];
+    int frag = (ip[6] & 0x3f) << 8 | ip[7];         // MF and offset
+    int proto = ip[9];
+
+    if ((proto != IP_PROTO_TCP && proto != IP_PROTO_UDP) || frag != 0)
+        return 0;
+    if (ihl < 20 || totlen < ihl || 14 + totlen > len)
+        return 0;
+    if (14 + ihl + (proto == IP_PROTO_TCP ? 18 : 8) > hlen)
+        return -1;
+
+    *l4 = 14 + ihl;
+    *l4len = totlen - ihl;
+    return proto;
+}
+
+// one's complement sum of the IPv4 pseudo header, with 16-bit
+// words taken in memory order like lwip_standard_chksum() does.
+static uint32
+csum_pseudo(uint8 *frame, int proto, int l4len)
+{
+    uint32 sum = 0;
+    for (int i = 14 + 12; i < 14 + 20; i += 2)      // source and destination
+        sum += frame[i] | frame[i+1] << 8;
+    sum += proto << 8;
+    sum += (l4len >> 8) | (l4len & 0xff) << 8;
+    return sum;
+}
+
+static uint16
+csum_fold(uint32 sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+// let the device compute the TCP/UDP checksum, which lwIP left
+// out for this netif: store the pseudo header sum in the checksum
+// field and tell the device where the field is. spec 5.1.6.2
+static void
+tx_csum(struct virtio_net_hdr *hdr, uint8 *frame, int hlen, int len)
+{
+    int l4, l4len;
+    int proto = csum_parse(frame, hlen, len, &l4, &l4len);
+    if (proto <= 0)
+        return;
+
+    int off = proto == IP_PROTO_TCP ? 16 : 6;
+    uint16 sum = csum_fold(csum_pseudo(frame, proto, l4len));
+    frame[l4 + off] = sum & 0xff;
+    frame[l4 + off + 1] = sum >> 8;
+
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = l4;
+    hdr->csum_offset = off;
+}
+
+// have the device segment a TCP packet longer than the MTU:
+// each frame it sends carries the headers and gso_size bytes
+// of payload. the checksum is completed as by tx_csum().
+// spec 5.1.6.2
+static void
+tx_gso(struct virtio_net_hdr *hdr, uint8 *frame, int hlen, int len)
+{
+    int l4, l4len;
+    if (csum_parse(frame, hlen, len, &l4, &l4len) != IP_PROTO_TCP)
+        return;
+
+    int thl = (frame[l4 + 12] >> 4) * 4;            // TCP data offset
+    int mss = net.mtu - (l4 - 14) - thl;
+    if (l4len - thl <= mss)
+        return;
+
+    hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr->hdr_len = l4 + thl;
+    hdr->gso_size = mss;
+}
+
+// check the TCP/UDP checksum of a received packet that the device
+// has not validated. other packets are left to lwIP.
+// the packet may be a chain; its headers are in the first pbuf.
+static int
+rx_csum_ok(struct pbuf *p)
+{
+    int l4, l4len;
+    uint8 *frame = p->payload;
+    int proto = csum_parse(frame, p->len, p->tot_len, &l4, &l4len);
+    if (proto <= 0)
+        return proto == 0;
+    if (proto == IP_PROTO_UDP && frame[l4 + 6] == 0 && frame[l4 + 7] == 0)
+        return 1;   // UDP without checksum
+
+    ip4_addr_t src, dst;
+    memmove(&src, frame + 14 + 12, sizeof(src));
+    memmove(&dst, frame + 14 + 16, sizeof(dst));
+
+    pbuf_remove_header(p, l4);
+    uint16 sum = inet_chksum_pseudo_partial(p, proto, l4len, l4len, &src, &dst);
+    pbuf_header_force(p, l4);
+    return sum == 0;
+}
+
+// must tx_post() copy the frame into a send buffer? a long chain
+// is copied into one buffer instead, and so is a frame whose headers
+// are split across pbufs when the device is to complete the checksum.
+static int
+tx_copy(struct pbuf *p, int nseg)
+{
+    int l4, l4len;
+    int csum = (net.features >> VIRTIO_NET_F_CSUM) & 1;
+    return nseg > TX_MAX_SEGS ||
+        (csum && csum_parse(p->payload, p->len, p->tot_len, &l4, &l4len) < 0);
+}
 
-    // get preallocated buffer by idx
-    void *buf = net.send_buf[idx];
+// post a frame to the TX ring as one buffer: the header followed
+// by one descriptor per pbuf. the device reads the pbufs
+// in place; the caller has taken a reference on p, which is
+// dropped once the chain comes back in the used ring.
+// returns -1 if there are not enough free descriptors.
+// caller holds nq->lock.
+static int
+tx_post(struct netq *nq, struct pbuf *p)
+{
+    struct pbuf *q;
+    int nseg = 0;
+
+    for (q = p; q != NULL; q = q->next)
+        if (q->len > 0)
+            nseg++;
+
+    // frames to be copied are at most a page long, see virtio_net_send()
+    int csum = (net.features >> VIRTIO_NET_F_CSUM) & 1;
+    int tso = (net.features >> VIRTIO_NET_F_HOST_TSO4) & 1;
+    int copy = tx_copy(p, nseg);
+    if (copy)
+        nseg = 1;
+
+    // one descriptor for the header plus one per segment
+    struct virtq_seg seg[1 + TX_MAX_SEGS];
+    if (!virtq_room(&nq->tx, 1 + nseg) || nq->tx_nid == 0)
+        return -1;
+    int id = nq->tx_id[--nq->tx_nid];
 
     // fill in the header fields
-    struct virtio_net_hdr *hdr = buf;
-    hdr->flags = 0;             // assume the packet is completely checksummed
+    struct virtio_net_hdr *hdr = &nq->tx_ops[id];
+    hdr->flags = 0;             // the packet is completely checksummed, unless tx_csum()
     hdr->csum_start = 0;        // unused
     hdr->csum_offset = 0;       // unused
     hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
@@ -312,105 +698,486 @@ int virtio_net_send(const void *data, int len) {
     hdr->gso_size = 0;          // unused
     hdr->num_buffers = 0;       // driver must set num_buffers to 0
 
-    // copy user data to the payload area
-    void *payload = (void *)hdr + sizeof(struct virtio_net_hdr);
-    memmove(payload, data, len);
+    if (copy)
+        pbuf_copy_partial(p, nq->send_buf[id], p->tot_len, 0);
+    uint8 *frame = copy ? nq->send_buf[id] : p->payload;
+    int hlen = copy ? p->tot_len : p->len;
+    if (csum)
+        tx_csum(hdr, frame, hlen, p->tot_len);
+    if (tso)
+        tx_gso(hdr, frame, hlen, p->tot_len);
+
+    seg[0] = (struct virtq_seg){ (uint64)hdr, sizeof(struct virtio_net_hdr), 0 };  // device only reads
+
+    // fill in one data descriptor per segment
+    if (copy) {
+        seg[1] = (struct virtq_seg){ (uint64)nq->send_buf[id], p->tot_len, 0 };
+    } else {
+        int i = 1;
+        for (q = p; q != NULL; q = q->next)
+            if (q->len > 0)
+                seg[i++] = (struct virtq_seg){ (uint64)q->payload, q->len, 0 };
+    }
+
+    nq->tx_pbuf[id] = p;
+    virtq_add(&nq->tx, seg, 1 + nseg, id);
+    nq->tx_posted++;
+    return 0;
+}
+
+// ask for a TX interrupt: right away while frames are waiting in
+// the backlog, otherwise once three quarters of the frames in
+// flight have been sent.
+static void
+tx_enable_intr(struct netq *nq)
+{
+    virtq_enable_intr(&nq->tx, nq->tx_bl_head == nq->tx_bl_tail);
+}
+
+// free the buffers the device has finished sending,
+// move their pbufs to tx_done[], and refill the ring from the
+// backlog. called on every interrupt, poll and send.
+// caller holds nq->lock.
+static void
+tx_reclaim(struct netq *nq)
+{
+    int posted = 0, id, len;
+
+    // stop early if tx_done[] is full; netd will free it
+    while (nq->tx_ndone < nq->tx.num && virtq_get(&nq->tx, &id, &len) == 0) {
+        nq->tx_done[nq->tx_ndone++] = nq->tx_pbuf[id];
+        nq->tx_pbuf[id] = 0;
+        nq->tx_id[nq->tx_nid++] = id;
+    }
+
+    // wake the queue: post waiting frames in order
+    while (nq->tx_bl_head != nq->tx_bl_tail) {
+        struct pbuf *p = nq->tx_backlog[nq->tx_bl_head % TX_BACKLOG];
+        if (tx_post(nq, p) < 0)
+            break;
+        nq->tx_bl_head++;
+        posted = 1;
+    }
+
+    if (posted && nq->batch == 0)
+        tx_kick(nq);
+}
+
+// free the pbufs of completed transmissions on one queue.
+// must be called in lwIP context, since the pbufs may
+// belong to lwIP's heap, and without the queue's lock.
+static void
+tx_free(struct netq *nq)
+{
+    struct pbuf *done[32];  // a batch at a time; the kernel stack is small
+    int n;
+
+    do {
+        acquire(&nq->lock);
+        tx_reclaim(nq);
+        n = nq->tx_ndone < NELEM(done) ? nq->tx_ndone : NELEM(done);
+        nq->tx_ndone -= n;
+        memmove(done, nq->tx_done + nq->tx_ndone, n * sizeof(done[0]));
+        release(&nq->lock);
+
+        for (int i = 0; i < n; i++)
+            pbuf_free(done[i]);
+    } while (n == NELEM(done));
+}
+
+// free the pbufs of completed transmissions on all queues.
+void
+virtio_net_txfree(void)
+{
+    for (int k = 0; k < net.npairs; k++)
+        tx_free(&net.q[k]);
+}
+
+/* send a frame held in a pbuf chain */
+// spec 5.1.6.2 Packet Transmission
+// the frame goes out as one buffer without copying.
+// if the ring is full, the queue stops and the frame waits in the
+// backlog. if the backlog is full too, the caller gets -1 and
+// lwIP retries later; it never sleeps here, since lwIP always runs
+// under lwip_lock. returns 0 once the frame has been queued.
+// each CPU sends on its own queue pair and takes only its lock.
+int virtio_net_send(struct pbuf *p) {
+    struct pbuf *clone = 0;
+    struct netq *nq;
+
+    if (p->tot_len == 0)
+        return -1;
+
+    push_off();
+    nq = &net.q[cpuid() % net.npairs];
+    pop_off();
+
+    // the send buffers hold a page. a longer (TSO) frame that would
+    // have to be copied is made contiguous here, in lwIP context.
+    if (p->tot_len > PGSIZE && tx_copy(p, pbuf_clen(p))) {
+        if ((clone = pbuf_clone(PBUF_RAW, PBUF_RAM, p)) == 0) {
+            acquire(&nq->lock);
+            nq->st.tx_drop_nomem++;
+            release(&nq->lock);
+            return -1;
+        }
+        p = clone;
+    }
 
-    // fill in the fields of the descriptor
-    net.tx.desc[idx].addr = (uint64)hdr;
-    net.tx.desc[idx].len = sizeof(struct virtio_net_hdr) + len;
-    net.tx.desc[idx].flags = 0;     // read-only
-    net.tx.desc[idx].next = 0;      // device only reads from this buffer
+    tx_free(nq);
+
+    acquire(&nq->lock);
+
+    // pick up completions; this may also drain the backlog
+    tx_reclaim(nq);
+
+    while (1) {
+        // frames in the backlog go first, to keep the order.
+        // the pbufs stay referenced until the device is done.
+        if (nq->tx_bl_head == nq->tx_bl_tail && tx_post(nq, p) == 0) {
+            pbuf_ref(p);
+            break;
+        }
+
+        if (nq->tx_bl_tail - nq->tx_bl_head < TX_BACKLOG) {
+            pbuf_ref(p);
+            nq->tx_backlog[nq->tx_bl_tail++ % TX_BACKLOG] = p;
+            nq->st.tx_ring_full++;
+            tx_enable_intr(nq);
+            break;
+        }
+
+        // the backlog is full as well
+        if (myproc() == 0) {
+            // interrupts are off: poll for completions
+            while (!virtq_pending(&nq->tx))
+                ;
+            tx_reclaim(nq);
+        } else {
+            // lwIP retries later
+            nq->st.tx_drop_busy++;
+            release(&nq->lock);
+            if (clone)
+                pbuf_free(clone);
+            return -1;
+        }
+    }
 
-    // update the available ring
-    net.tx.avail->ring[net.tx.avail->idx % NUM] = idx;
-    __sync_synchronize();  // TODO: why?
-    net.tx.avail->idx++;
+    nq->st.tx_packets++;
+    nq->st.tx_bytes += p->tot_len;
 
-    // notify the device
-    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 1;  // queue number of TX
+    // inside a batch the device is notified by virtio_net_batch_end()
+    if (nq->batch == 0 || myproc() == 0)
+        tx_kick(nq);
 
     // if called during initialization, wait for the device to process the packet
     if (myproc() == 0) {
         // should not sleep because interrupt is disabled
-        // user->idx is incremented by the device
-        while (net.tx.used->idx == net.tx.used_idx)
-            ;
-
-        struct virtq_used_elem *e = &net.tx.used->ring[net.tx.used_idx % NUM];
-        free_desc(&net.tx, e->id);
-        net.tx.used_idx++;
+        // the device returns every buffer in flight
+        while (nq->tx.num_free != nq->tx.num ||
+               nq->tx_bl_head != nq->tx_bl_tail) {
+            tx_reclaim(nq);
+            tx_kick(nq);
+        }
+        tx_reclaim(nq);
     }
 
-    release(&net.vnet_lock);
+    release(&nq->lock);
+
+    if (myproc() == 0)
+        tx_free(nq);
+    if (clone)
+        pbuf_free(clone);   // the ring holds its own reference
     
     return 0;
 }
 
-/* receive data; return the number of bytes received */
-// spec 5.1.6.4 Processing of Incoming Packets
-int virtio_net_recv(void *data, int len) {
-    acquire(&net.vnet_lock);
+// custom pbuf free function: give the page back to the pool,
+// for rx_one() to post again.
+static void
+rx_pbuf_free(struct pbuf *p)
+{
+    pp_put(&net.pool, (char *)p - RX_BUFLEN);
+}
+
+// Take one packet off the RX queue; caller holds nq->lock.
+// A packet occupies num_buffers consecutive used buffers, whose
+// buffers become one pbuf chain. Sets *pp to a chain that refers
+// to the receive pages themselves, or to NULL if the packet had
+// to be dropped. The buffer ids are re-posted at once, with fresh
+// pages from the pool, so that the ring never runs dry.
+// Returns -1, taking nothing, if the device has not published
+// all buffers of the packet yet.
+static int
+rx_one(struct netq *nq, struct pbuf **pp)
+{
+    int idx[RX_MAXBUFS], len[RX_MAXBUFS], total = 0;
+    void *fresh[RX_MAXBUFS];
+    struct pbuf *p = NULL;
 
-    // return immediately if there is no packet to receive
-    if (net.rx.used->idx == net.rx.used_idx) {
-        release(&net.vnet_lock);
+    if (!virtq_pending(&nq->rx))
+        return -1;
+    struct virtio_net_hdr *hdr = nq->rx_page[virtq_peek(&nq->rx)];    // at the start of the first buffer
+    int nbuf = hdr->num_buffers ? hdr->num_buffers : 1;
+    int check = (net.features >> VIRTIO_NET_F_GUEST_CSUM) & 1 &&
+        !(hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID));
+
+    if (nbuf > RX_MAXBUFS) {
+        // no packet of ours is this long: drop the buffer that
+        // claims it, and take whatever follows as a new packet
+        virtq_get(&nq->rx, &idx[0], &len[0]);
+        fill_rx(nq, idx[0]);
+        nq->st.rx_drop_bad++;
+        *pp = NULL;
         return 0;
     }
+    if (!virtq_ready(&nq->rx, nbuf))
+        return -1;
 
-    // get received packet
-    int hdr_idx, data_idx, data_len;
-    struct virtq_used_elem *used;
-    void *data_ptr;
+    // collect the buffers; the first one starts with the header
+    for (int k = 0; k < nbuf; k++) {
+        virtq_get(&nq->rx, &idx[k], &len[k]);
+        len[k] -= k == 0 ? sizeof(struct virtio_net_hdr) : 0;
+        total += len[k];
+    }
+
+    int nfresh = 0;
+    while (nfresh < nbuf && (fresh[nfresh] = pp_get(&net.pool)) != 0)
+        nfresh++;
+
+    if (nfresh == nbuf) {
+        // hand the pages to lwIP; each goes back to the pool
+        // through rx_pbuf_free()
+        for (int k = 0; k < nbuf; k++) {
+            int off = k == 0 ? sizeof(struct virtio_net_hdr) : 0;
+            char *page = nq->rx_page[idx[k]];
+            struct rx_pbuf *rp = (struct rx_pbuf *)(page + RX_BUFLEN);
+            rp->pc.custom_free_function = rx_pbuf_free;
+            struct pbuf *q = pbuf_alloced_custom(PBUF_RAW, len[k], PBUF_REF, &rp->pc,
+                                                 page + off, RX_BUFLEN - off);
+            if (p == NULL)
+                p = q;
+            else
+                pbuf_cat(p, q);
+            nq->rx_page[idx[k]] = fresh[k];
+            fill_rx(nq, idx[k]);
+        }
+    } else {
+        // lwIP holds every spare page: copy the data out
+        // and post the same pages again.
+        while (nfresh > 0)
+            pp_put(&net.pool, fresh[--nfresh]);
+        p = pbuf_alloc(PBUF_RAW, total, PBUF_RAM);
+        for (int k = 0, off = 0; k < nbuf; off += len[k], k++) {
+            int hoff = k == 0 ? sizeof(struct virtio_net_hdr) : 0;
+            if (p != NULL)
+                pbuf_take_at(p, (char *)nq->rx_page[idx[k]] + hoff, len[k], off);
+            fill_rx(nq, idx[k]);
+        }
+        nq->st.rx_copied++;
+        if (p == NULL)
+            nq->st.rx_drop_nomem++;
+    }
+
+    // with VIRTIO_NET_F_GUEST_CSUM lwIP does not check TCP/UDP
+    // checksums; verify those the device did not vouch for.
+    if (p != NULL && check && !rx_csum_ok(p)) {
+        pbuf_free(p);
+        nq->st.rx_drop_csum++;
+        p = NULL;
+    }
+
+    if (p != NULL) {
+        nq->st.rx_packets++;
+        nq->st.rx_bytes += total;
+    }
+    *pp = p;
+    return 0;
+}
+
+/* receive up to max packets; return the number of packets taken */
+// spec 5.1.6.4 Processing of Incoming Packets
+// drains the RX used rings of all queue pairs, starting with a
+// different pair each time, under one acquisition of each pair's lock.
+// pkts[i] refers to the receive buffers themselves, or is NULL if the
+// packet had to be dropped. buffers recycled here are handed back
+// to the device with one notification per queue for the whole batch.
+int virtio_net_recv(struct pbuf **pkts, int max) {
+    int n = 0;
+    int first = net.rx_next++ % net.npairs;
+
+    for (int k = 0; k < net.npairs && n < max; k++) {
+        struct netq *nq = &net.q[(first + k) % net.npairs];
 
-    used = &net.rx.used->ring[net.rx.used_idx % (2 * NUM)];
-    hdr_idx = used->id;                                     // index of the header descriptor
-    data_idx = net.rx.desc[hdr_idx].next;                   // index of the data descriptor
-    data_ptr = (void *)net.rx.desc[data_idx].addr;          // address of the data
-    data_len = used->len - sizeof(struct virtio_net_hdr);   // length of the data
+        acquire(&nq->lock);
 
-    // copy the data to the user buffer
-    memmove(data, data_ptr, data_len);
+        // reclaim TX completions on every poll as well
+        tx_reclaim(nq);
 
-    // update bookkeeping info
-    net.rx.used_idx++;
+        int n0 = n;
+        while (n < max && rx_one(nq, &pkts[n]) == 0)
+            n++;
+        nq->st.rx_polls++;
+        nq->st.rx_batch[hist_bucket(n - n0)]++;
 
-    // refill RX and notify the device
-    // reuse the descriptor chain, no need to free and allocate it
-    fill_rx(hdr_idx/2);
+        if (nq->batch == 0)
+            rx_kick(nq);
 
-    release(&net.vnet_lock);
+        release(&nq->lock);
+    }
     
-    return data_len;
+    return n;
 }
 
-// TODO: somehow this function is never called after the initialization
-// will be called in trap.c devintr()
+// open a batch: until the matching virtio_net_batch_end(), sent
+// frames and recycled receive buffers are only published in the
+// rings, and the device is notified once per queue at the end.
 void
-virtio_net_intr(void)
+virtio_net_batch_begin(void)
 {
-    printf("virtio_net_intr\n");
-    acquire(&net.vnet_lock);
-
-    // only handle Used Buffer Notification (0x1) for now
-    if (!(*R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x1)) {
-        panic("virtio_net_intr: Configuration Change Notification");
+    for (int k = 0; k < net.npairs; k++) {
+        struct netq *nq = &net.q[k];
+        acquire(&nq->lock);
+        nq->batch++;
+        release(&nq->lock);
     }
+}
 
-    // incoming packet: wake up potential waiters
-    if (net.rx.used->idx > net.rx.used_idx) {
-        // descriptor chain is freed in virtio_net_recv()
-        wakeup(&net.rx);
+void
+virtio_net_batch_end(void)
+{
+    for (int k = 0; k < net.npairs; k++) {
+        struct netq *nq = &net.q[k];
+        acquire(&nq->lock);
+        if (--nq->batch == 0) {
+            tx_kick(nq);
+            rx_kick(nq);
+        }
+        release(&nq->lock);
     }
+}
+
+// does a queue pair have work for the network thread?
+// if not, asks for an interrupt on the next received packet, see
+// virtio_net_intr(), and see
+// tx_enable_intr() for sent packets. the rings are checked
+// afterwards, since the device may have used a buffer before
+// it saw the new event index.
+static int
+rx_tx_pending(struct netq *nq)
+{
+    acquire(&nq->lock);
+    virtq_enable_intr(&nq->rx, 0);
+    tx_enable_intr(nq);
+    int pending = virtq_pending(&nq->rx) || virtq_pending(&nq->tx) || nq->tx_ndone > 0;
+    release(&nq->lock);
+    return pending;
+}
 
-    // outgoing packet: free descriptors and do some bookkeeping
-    if (net.tx.used->idx > net.tx.used_idx) {
-        free_desc(&net.tx, net.tx.used->ring[net.tx.used_idx % NUM].id);
-        net.tx.used_idx++;
+// sleep until the device has placed a received packet
+// in an RX used ring or finished sending a packet, or until
+// r_mtime() reaches deadline, unless it is 0.
+// called by the network thread in net.c.
+void
+virtio_net_wait(uint64 deadline)
+{
+    acquire(&net.wait_lock);
+    net.deadline = deadline;
+    while (!net.wake && (deadline == 0 || r_mtime() < deadline)) {
+        int pending = 0;
+        for (int k = 0; k < net.npairs; k++)
+            pending |= rx_tx_pending(&net.q[k]);
+        if (pending)
+            break;
+        sleep(&net.wake, &net.wait_lock);
     }
+    net.deadline = 0;
+    net.wake = 0;
+    net.wakeups++;
+    release(&net.wait_lock);
+}
+
+// called from clockintr() on every tick, to end a
+// virtio_net_wait() whose deadline has passed.
+void
+virtio_net_clock(void)
+{
+    if (net.deadline == 0)
+        return;
+
+    acquire(&net.wait_lock);
+    if (net.deadline && r_mtime() >= net.deadline)
+        wakeup(&net.wake);
+    release(&net.wait_lock);
+}
+
+// called from trap.c devintr() on a used buffer notification.
+// received packets are left in the RX queues, and sent pbufs
+// in tx_done[], for the network thread, which runs lwIP outside
+// interrupt context. all queues share the one interrupt.
+// like Linux's NAPI, the first received packet turns the RX
+// interrupts off, and the network thread polls the queues until
+// they are empty before virtio_net_wait() turns them back on.
+void
+virtio_net_intr(void)
+{
+    int pending = 0;
 
-    // acknowledge the interrupt
+    // acknowledge before looking at the rings, so that a buffer
+    // used after this point raises a new interrupt.
+    // configuration changes (0x2) need no action from us.
     *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+    __sync_synchronize();
+    __sync_fetch_and_add(&net.intrs, 1);
+
+    for (int k = 0; k < net.npairs; k++) {
+        struct netq *nq = &net.q[k];
+        acquire(&nq->lock);
+
+        // outgoing packet: free every completed descriptor chain
+        tx_reclaim(nq);
+
+        if (virtq_pending(&nq->rx)) {
+            virtq_disable_intr(&nq->rx);
+            pending = 1;
+        }
+        if (nq->tx_ndone > 0)
+            pending = 1;
+        release(&nq->lock);
+    }
+
+    // wake up the network thread
+    if (pending)
+        virtio_net_wakeup();
+}
 
-    release(&net.vnet_lock);
-}
\ No newline at end of file
+// end the network thread's virtio_net_wait(), or make the next
+// one return at once. called on interrupts, and by net.c when
+// a system call has work for it.
+void
+virtio_net_wakeup(void)
+{
+    acquire(&net.wait_lock);
+    net.wake = 1;
+    wakeup(&net.wake);
+    release(&net.wait_lock);
+}
+
+// copy the driver's counters into st.
+void
+virtio_net_stats(struct netstat *st)
+{
+    st->npairs = net.npairs;
+    st->intrs = net.intrs;
+    pp_stats(&net.pool, &st->rxpool_pages, &st->rxpool_free,
+             &st->rxpool_trips, &st->rxpool_empty);
+    acquire(&net.wait_lock);
+    st->wakeups = net.wakeups;
+    release(&net.wait_lock);
+    for (int k = 0; k < net.npairs; k++) {
+        struct netq *nq = &net.q[k];
+        acquire(&nq->lock);
+        st->q[k] = nq->st;
+        release(&nq->lock);
+    }
+}
@@ -0,0 +1,633 @@
+//
+// virtqueues for the virtio drivers, over qemu's mmio interface.
+// one set of ring code for virtio_disk.c and virtio_net.c, in the
+// split or packed layout, with or without indirect descriptors,
+// as negotiated with each device.
+//
+// the driver adds buffers with virtq_add(), each named by an id
+// below the queue size, tells the device with virtq_kick(), and
+// takes them back with virtq_get() once they are used.
+// the caller serializes access to a queue.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "virtio.h"
+#include "virtq.h"
+
+// allocate and zero n bytes of physically contiguous memory,
+// in whole pages. the rings of a large queue take more than one.
+static void *
+qalloc(uint64 n)
+{
+    int npages = (n + PGSIZE - 1) / PGSIZE;
+    void *p = npages == 1 ? kalloc() : kallocn(npages);
+    if (p == 0)
+        panic("virtq: out of memory");
+    memset(p, 0, npages * PGSIZE);
+    return p;
+}
+
+// free memory from qalloc(n).
+static void
+qfree(void *p, uint64 n)
+{
+    for (uint64 off = 0; off < n; off += PGSIZE)
+        kfree((char *)p + off);
+}
+
+// the memory of a queue of num descriptors, in either layout.
+// the split rings are followed by their event index fields.
+static uint64
+ring_size(int num, int packed)
+{
+    return packed ? num * sizeof(struct pvirtq_desc) : num * sizeof(struct virtq_desc);
+}
+
+static uint64
+avail_size(int num, int packed)
+{
+    return packed ? 2 * sizeof(struct pvirtq_event) :
+        sizeof(struct virtq_avail) + (num + 1) * sizeof(uint16);
+}
+
+static uint64
+used_size(int num)
+{
+    return sizeof(struct virtq_used) + num * sizeof(struct virtq_used_elem) + sizeof(uint16);
+}
+
+static uint64
+indirect_size(struct virtqueue *q)
+{
+    return (uint64)q->num * q->max_segs * sizeof(struct virtq_desc);
+}
+
+// allocate and initialize the memory and book-keeping of a queue
+// of num descriptors, for buffers of up to max_segs segments, in
+// the layout given by the negotiated features. the device is not
+// told about it.
+void
+virtq_alloc(struct virtqueue *q, int num, uint64 features, int max_segs)
+{
+    memset(q, 0, sizeof(*q));
+    q->packed = (features >> VIRTIO_F_RING_PACKED) & 1;
+    q->event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+    q->num = num;
+    q->num_free = num;
+    q->max_segs = max_segs;
+
+    if (q->packed) {
+        q->ring = qalloc(ring_size(num, 1));
+        q->driver_event = qalloc(avail_size(num, 1));
+        q->device_event = q->driver_event + 1;
+        q->id_len = qalloc(num * sizeof(uint16));
+        // the wrap counters start at 1. spec 2.7.1
+        q->avail_wrap = 1;
+        q->used_wrap = 1;
+    } else {
+        q->desc = qalloc(ring_size(num, 0));
+        q->avail = qalloc(avail_size(num, 0));
+        q->used = qalloc(used_size(num));
+        q->head_id = qalloc(num * sizeof(uint16));
+        q->free = qalloc(num);
+        for (int i = 0; i < num; i++) {
+            q->desc[i].next = i + 1;
+            q->free[i] = 1;
+        }
+    }
+
+    // a buffer of one segment needs no table.
+    if (((features >> VIRTIO_RING_F_INDIRECT_DESC) & 1) && max_segs > 1)
+        q->indirect = qalloc(indirect_size(q));
+}
+
+// undo virtq_alloc().
+void
+virtq_free(struct virtqueue *q)
+{
+    if (q->packed) {
+        qfree(q->ring, ring_size(q->num, 1));
+        qfree(q->driver_event, avail_size(q->num, 1));
+        qfree(q->id_len, q->num * sizeof(uint16));
+    } else {
+        qfree(q->desc, ring_size(q->num, 0));
+        qfree(q->avail, avail_size(q->num, 0));
+        qfree(q->used, used_size(q->num));
+        qfree(q->head_id, q->num * sizeof(uint16));
+        qfree(q->free, q->num);
+    }
+    if (q->indirect)
+        qfree(q->indirect, indirect_size(q));
+}
+
+// set up queue qidx of the device whose registers start at base,
+// with target descriptors, or fewer if the device does not support
+// that many, but no fewer than min.
+// spec 4.2.3.2 Virtqueue Configuration
+void
+virtq_init(struct virtqueue *q, uint64 base, int qidx, int target, int min,
+           uint64 features, int max_segs)
+{
+    volatile uint32 *regs = (volatile uint32 *)base;
+#define REG(r) regs[(r) / sizeof(uint32)]
+
+    // 1. select a queue by writing to queuesel
+    REG(VIRTIO_MMIO_QUEUE_SEL) = qidx;
+
+    // 2. check if the queue is already in use
+    if (REG(VIRTIO_MMIO_QUEUE_READY))
+        panic("virtq_init: queue already in use");
+
+    // 3. check if the queue is available (queue-num-max != 0)
+    uint32 max = REG(VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if (max == 0)
+        panic("virtq_init: queue not available");
+
+    // the size of a split virtqueue is a power of two. spec 2.6
+    // a packed one need not be, but we keep to the same sizes.
+    uint32 num = 1;
+    while (num * 2 <= target && num * 2 <= max)
+        num *= 2;
+    if (num < min)
+        panic("virtq_init: queue too short");
+
+    // 4. allocate and zero the queue memory
+    virtq_alloc(q, num, features, max_segs);
+    q->notify = &REG(VIRTIO_MMIO_QUEUE_NOTIFY);
+    q->qidx = qidx;
+
+    // 5. notify the device about the queue size
+    REG(VIRTIO_MMIO_QUEUE_NUM) = q->num;
+
+    // 6. write PA of three parts of the queue to the device
+    // a packed queue passes its ring, and the driver and device
+    // event suppression structures in place of the rings.
+    uint64 desc = q->packed ? (uint64)q->ring : (uint64)q->desc;
+    uint64 driver = q->packed ? (uint64)q->driver_event : (uint64)q->avail;
+    uint64 device = q->packed ? (uint64)q->device_event : (uint64)q->used;
+    REG(VIRTIO_MMIO_QUEUE_DESC_LOW)   = desc;
+    REG(VIRTIO_MMIO_QUEUE_DESC_HIGH)  = desc >> 32;
+    REG(VIRTIO_MMIO_DRIVER_DESC_LOW)  = driver;
+    REG(VIRTIO_MMIO_DRIVER_DESC_HIGH) = driver >> 32;
+    REG(VIRTIO_MMIO_DEVICE_DESC_LOW)  = device;
+    REG(VIRTIO_MMIO_DEVICE_DESC_HIGH) = device >> 32;
+
+    // 7. tell the device that the queue is ready
+    REG(VIRTIO_MMIO_QUEUE_READY) = 1;
+#undef REG
+}
+
+// spec 2.6.7.2: should the side waiting for event_idx be told that
+// the ring index moved from old to new_idx?
+static inline int
+need_event(uint16 event_idx, uint16 new_idx, uint16 old)
+{
+    return (uint16)(new_idx - event_idx - 1) < (uint16)(new_idx - old);
+}
+
+// pop a free descriptor off the free stack, return its index.
+static int
+alloc_desc(struct virtqueue *q)
+{
+    if (q->num_free == 0)
+        return -1;
+    int i = q->free_head;
+    q->free_head = q->desc[i].next;
+    q->free[i] = 0;
+    q->num_free--;
+    return i;
+}
+
+// push a descriptor onto the free stack.
+static void
+free_desc(struct virtqueue *q, int i)
+{
+    if (i >= q->num)
+        panic("free_desc: out of range");
+    if (q->free[i])
+        panic("free_desc: double free");
+    q->free[i] = 1;
+    q->desc[i].addr = 0;
+    q->desc[i].next = q->free_head;
+    q->free_head = i;
+    q->num_free++;
+}
+
+// free a chain of descriptors.
+static void
+free_chain(struct virtqueue *q, int i)
+{
+    while (1) {
+        int flags = q->desc[i].flags;
+        int next = q->desc[i].next;   // free_desc() overwrites it
+        free_desc(q, i);
+        if (flags & VIRTQ_DESC_F_NEXT)
+            i = next;
+        else
+            break;
+    }
+}
+
+// the ring descriptors a buffer of n segments takes.
+static int
+ring_descs(struct virtqueue *q, int n)
+{
+    return q->indirect && n > 1 ? 1 : n;
+}
+
+// is there room in q for a buffer of n segments?
+int
+virtq_room(struct virtqueue *q, int n)
+{
+    return q->num_free >= ring_descs(q, n);
+}
+
+// add a buffer of n segments to q, as buffer id. the device
+// is not notified until virtq_kick(). returns -1 if there are not
+// enough free descriptors.
+int
+virtq_add(struct virtqueue *q, struct virtq_seg *seg, int n, int id)
+{
+    struct virtq_seg table;
+    uint16 extra = 0;
+
+    if (n > q->max_segs || id >= q->num)
+        panic("virtq_add");
+    if (!virtq_room(q, n))
+        return -1;
+
+    // with indirect descriptors the segments go to the id's own
+    // table, and the ring gets one descriptor pointing to it.
+    // spec 2.6.5.3, 2.7.6
+    if (ring_descs(q, n) < n) {
+        if (q->packed) {
+            struct pvirtq_desc *t = (struct pvirtq_desc *)q->indirect + id * q->max_segs;
+            for (int k = 0; k < n; k++) {
+                t[k].addr = seg[k].addr;
+                t[k].len = seg[k].len;
+                t[k].id = 0;
+                t[k].flags = seg[k].write ? VIRTQ_DESC_F_WRITE : 0;
+            }
+            table.addr = (uint64)t;
+        } else {
+            struct virtq_desc *t = (struct virtq_desc *)q->indirect + id * q->max_segs;
+            for (int k = 0; k < n; k++) {
+                t[k].addr = seg[k].addr;
+                t[k].len = seg[k].len;
+                t[k].flags = (seg[k].write ? VIRTQ_DESC_F_WRITE : 0) |
+                    (k < n - 1 ? VIRTQ_DESC_F_NEXT : 0);
+                t[k].next = k + 1;
+            }
+            table.addr = (uint64)t;
+        }
+        table.len = n * sizeof(struct virtq_desc);
+        table.write = 0;
+        seg = &table;
+        n = 1;
+        extra = VIRTQ_DESC_F_INDIRECT;
+    }
+
+    if (q->packed) {
+        // fill the descriptors in ring order. the first one's flags
+        // are written last, since they hand the whole buffer to the
+        // device. spec 2.7.21.1
+        int i = q->avail_idx, wrap = q->avail_wrap;
+        uint16 head = i, head_flags = 0;
+        for (int k = 0; k < n; k++) {
+            uint16 flags = extra | (wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+            if (k < n - 1)
+                flags |= VIRTQ_DESC_F_NEXT;
+            if (seg[k].write)
+                flags |= VIRTQ_DESC_F_WRITE;
+            q->ring[i].addr = seg[k].addr;
+            q->ring[i].len = seg[k].len;
+            q->ring[i].id = id;
+            if (k == 0)
+                head_flags = flags;
+            else
+                q->ring[i].flags = flags;
+            if (++i == q->num) {
+                i = 0;
+                wrap ^= 1;
+            }
+        }
+        q->avail_idx = i;
+        q->avail_wrap = wrap;
+        q->num_added += n;
+        q->num_free -= n;
+        q->id_len[id] = n;
+        __sync_synchronize();  // descriptors must be visible before the flags
+        q->ring[head].flags = head_flags;
+    } else {
+        int head = -1, prev = -1;
+        for (int k = 0; k < n; k++) {
+            int i = alloc_desc(q);
+            q->desc[i].addr = seg[k].addr;
+            q->desc[i].len = seg[k].len;
+            q->desc[i].flags = extra | (seg[k].write ? VIRTQ_DESC_F_WRITE : 0);
+            q->desc[i].next = 0;
+            if (prev < 0)
+                head = i;
+            else {
+                q->desc[prev].flags |= VIRTQ_DESC_F_NEXT;
+                q->desc[prev].next = i;
+            }
+            prev = i;
+        }
+        q->head_id[head] = id;
+        q->avail->ring[q->avail->idx % q->num] = head;
+        __sync_synchronize();  // descriptors must be visible before the index
+        q->avail->idx++;
+    }
+    return 0;
+}
+
+// has the device used at least n more buffers of q?
+int
+virtq_ready(struct virtqueue *q, int n)
+{
+    if (!q->packed)
+        return (uint16)(q->used->idx - q->used_idx) >= n;
+
+    // a used descriptor has AVAIL and USED both equal to the used
+    // wrap counter, and stands for as many ring entries as the
+    // buffer had descriptors. spec 2.7.7
+    int i = q->used_idx, wrap = q->used_wrap;
+    for (int k = 0; k < n; k++) {
+        uint16 flags = q->ring[i].flags;
+        if (((flags & VIRTQ_DESC_F_AVAIL) != 0) != wrap ||
+            ((flags & VIRTQ_DESC_F_USED) != 0) != wrap)
+            return 0;
+        __sync_synchronize();  // read the id after the flags
+        i += q->id_len[q->ring[i].id];
+        if (i >= q->num) {
+            i -= q->num;
+            wrap ^= 1;
+        }
+    }
+    return 1;
+}
+
+// has the device used a buffer we have not taken yet?
+int
+virtq_pending(struct virtqueue *q)
+{
+    return virtq_ready(q, 1);
+}
+
+// the id of the next used buffer; the caller has checked that
+// there is one.
+int
+virtq_peek(struct virtqueue *q)
+{
+    __sync_synchronize();
+    if (q->packed)
+        return q->ring[q->used_idx].id;
+    return q->head_id[q->used->ring[q->used_idx % q->num].id];
+}
+
+// take the next used buffer off q and free its descriptors.
+// sets *id to the buffer's id and *len to the number of bytes the
+// device wrote into it. returns -1 if there is none.
+int
+virtq_get(struct virtqueue *q, int *id, int *len)
+{
+    if (!virtq_pending(q))
+        return -1;
+    __sync_synchronize();  // read the entry after seeing it
+
+    if (q->packed) {
+        struct pvirtq_desc *d = &q->ring[q->used_idx];
+        *id = d->id;
+        *len = d->len;
+        q->num_free += q->id_len[*id];
+        q->used_idx += q->id_len[*id];
+        if (q->used_idx >= q->num) {
+            q->used_idx -= q->num;
+            q->used_wrap ^= 1;
+        }
+    } else {
+        struct virtq_used_elem *e = &q->used->ring[q->used_idx++ % q->num];
+        *id = q->head_id[e->id];
+        *len = e->len;
+        free_chain(q, e->id);
+    }
+    return 0;
+}
+
+// the number of buffers (split) or descriptors (packed) in flight.
+int
+virtq_inflight(struct virtqueue *q)
+{
+    if (q->packed)
+        return q->num - q->num_free;
+    return (uint16)(q->avail->idx - q->used_idx);
+}
+
+// notify the device about the buffers added since the last kick,
+// unless it has told us that it does not need to hear about them.
+// one MMIO write, and under qemu one VM exit, per batch at most.
+// returns 1 if the device was notified.
+int
+virtq_kick(struct virtqueue *q)
+{
+    int need;
+
+    if (q->packed) {
+        // positions are in ring order; old may lie in the previous
+        // lap, which the 16-bit arithmetic of need_event() allows
+        // for once the device's event offset is moved there as well.
+        uint16 new = q->avail_idx;
+        uint16 old = new - q->num_added;
+        if (q->num_added == 0)
+            return 0;
+        q->num_added = 0;
+
+        // the new descriptors must be visible before we read the event
+        __sync_synchronize();
+        uint16 flags = q->device_event->flags;
+        if (flags == RING_EVENT_FLAGS_DESC) {
+            uint16 off_wrap = q->device_event->off_wrap;
+            uint16 event = off_wrap & 0x7fff;
+            if ((off_wrap >> 15) != q->avail_wrap)
+                event -= q->num;
+            need = need_event(event, new, old);
+        } else {
+            need = flags != RING_EVENT_FLAGS_DISABLE;
+        }
+    } else {
+        uint16 old = q->kick_idx;
+        uint16 new = q->avail->idx;
+
+        if (new == old)
+            return 0;
+        q->kick_idx = new;
+
+        // the new avail->idx must be visible before we read the event
+        __sync_synchronize();
+        if (q->event_idx)
+            need = need_event(VIRTQ_AVAIL_EVENT(q->used, q->num), new, old);
+        else
+            need = !(q->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (!need || !q->notify)
+        return 0;
+    *q->notify = q->qidx;
+    return 1;
+}
+
+// ask for an interrupt once the device has used the next buffer
+// of q, or if delayed, once it has used about three quarters of
+// those in flight. without VIRTIO_RING_F_EVENT_IDX the device
+// interrupts for every used buffer, until virtq_disable_intr().
+void
+virtq_enable_intr(struct virtqueue *q, int delayed)
+{
+    if (!q->event_idx) {
+        if (q->packed)
+            q->driver_event->flags = RING_EVENT_FLAGS_ENABLE;
+        else
+            q->avail->flags = 0;
+        __sync_synchronize();
+        return;
+    }
+
+    uint16 delay = delayed ? virtq_inflight(q) * 3 / 4 : 0;
+    if (q->packed) {
+        int off = q->used_idx + delay, wrap = q->used_wrap;
+        if (off >= q->num) {
+            off -= q->num;
+            wrap ^= 1;
+        }
+        q->driver_event->off_wrap = off | wrap << 15;
+        __sync_synchronize();
+        q->driver_event->flags = RING_EVENT_FLAGS_DESC;
+    } else {
+        VIRTQ_USED_EVENT(q->avail, q->num) = q->used_idx + delay;
+    }
+    __sync_synchronize();
+}
+
+// ask the device not to interrupt for buffers of q, while the
+// driver polls it. only a hint: the device may still interrupt.
+// with VIRTIO_RING_F_EVENT_IDX the split layout needs nothing,
+// since the device has already passed the event index it was
+// given, and will not interrupt until virtq_enable_intr().
+void
+virtq_disable_intr(struct virtqueue *q)
+{
+    if (q->packed)
+        q->driver_event->flags = RING_EVENT_FLAGS_DISABLE;
+    else if (!q->event_idx)
+        q->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+#ifdef BENCH
+// ring size, batch and frame of virtq_bench().
+#define BENCH_RING  256
+#define BENCH_BATCH 32
+#define BENCH_FRAME 1514
+
+// the device side of virtq_bench(): use every buffer made
+// available in q, in order, as a device would after reading its
+// descriptors. pos and wrap track the device's ring position.
+static void
+bench_device(struct virtqueue *q, uint16 *pos, int *wrap)
+{
+    if (q->packed) {
+        while (1) {
+            struct pvirtq_desc *d = &q->ring[*pos];
+            uint16 flags = d->flags;
+            if (((flags & VIRTQ_DESC_F_AVAIL) != 0) != *wrap ||
+                ((flags & VIRTQ_DESC_F_USED) != 0) == *wrap)
+                break;
+            __sync_synchronize();
+
+            // walk the buffer; the id is in its last descriptor
+            int n = 0, i = *pos, id;
+            uint32 len = 0;
+            do {
+                flags = q->ring[i].flags;
+                len += q->ring[i].len;
+                id = q->ring[i].id;
+                n++;
+                i = (i + 1) % q->num;
+            } while (flags & VIRTQ_DESC_F_NEXT);
+
+            // write the used descriptor in place of the first one
+            d->id = id;
+            d->len = len;
+            __sync_synchronize();
+            d->flags = *wrap ? VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_USED : 0;
+            if ((*pos += n) >= q->num) {
+                *pos -= q->num;
+                *wrap ^= 1;
+            }
+        }
+    } else {
+        while (*pos != q->avail->idx) {
+            __sync_synchronize();
+            int head = q->avail->ring[*pos % q->num];
+            uint32 len = 0;
+            for (int i = head; ; i = q->desc[i].next) {
+                len += q->desc[i].len;
+                if (!(q->desc[i].flags & VIRTQ_DESC_F_NEXT))
+                    break;
+            }
+            struct virtq_used_elem *e = &q->used->ring[q->used->idx % q->num];
+            e->id = head;
+            e->len = len;
+            __sync_synchronize();
+            q->used->idx++;
+            (*pos)++;
+        }
+    }
+}
+
+// microbenchmark of the two ring layouts: pass n frames of a
+// virtio-net header and one data segment through a queue that
+// belongs to no device, in batches, with the device's part played
+// by bench_device(). returns the time taken, in CLINT_MTIME ticks,
+// or -1 if the layout is not known. what is measured is the
+// driver's ring code; the device and the notifications are left out.
+uint64
+virtq_bench(int packed, int n)
+{
+    struct virtqueue q;
+    struct virtq_seg seg[2];
+    uint16 pos = 0;
+    int wrap = 1;
+
+    if (packed != 0 && packed != 1)
+        return -1;
+
+    virtq_alloc(&q, BENCH_RING, (1L << VIRTIO_RING_F_EVENT_IDX) |
+                ((uint64)packed << VIRTIO_F_RING_PACKED), 2);
+    char *buf = qalloc(PGSIZE);
+    seg[0] = (struct virtq_seg){ (uint64)buf, 12, 0 };
+    seg[1] = (struct virtq_seg){ (uint64)buf + 64, BENCH_FRAME, 0 };
+
+    uint64 start = *(volatile uint64 *)CLINT_MTIME;
+    for (int sent = 0, done = 0; done < n; ) {
+        int id, len;
+        for (int b = 0; b < BENCH_BATCH && sent < n; b++, sent++)
+            if (virtq_add(&q, seg, 2, b) < 0)
+                panic("virtq_bench");
+        virtq_kick(&q);
+        bench_device(&q, &pos, &wrap);
+        while (virtq_get(&q, &id, &len) == 0)
+            done++;
+        virtq_enable_intr(&q, 1);
+    }
+    uint64 elapsed = *(volatile uint64 *)CLINT_MTIME - start;
+
+    qfree(buf, PGSIZE);
+    virtq_free(&q);
+    return elapsed;
+}
+#endif
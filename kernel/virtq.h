@@ -0,0 +1,65 @@
+// a virtqueue, in either of the two layouts the spec defines,
+// shared by the virtio drivers. see virtq.c.
+// with VIRTIO_F_RING_PACKED the descriptors and the completions
+// share one ring, so a request touches fewer cache lines than with
+// the split layout's descriptor table, avail ring and used ring.
+// with VIRTIO_RING_F_INDIRECT_DESC a buffer of several segments
+// takes one ring slot, which points to a table of its own.
+struct virtqueue {
+    int packed;         // packed layout (spec 2.7), otherwise split (spec 2.6)
+    int event_idx;      // VIRTIO_RING_F_EVENT_IDX negotiated?
+
+    // split layout.
+    // The descriptor table tells the device where to read and write
+    // individual operations.
+    struct virtq_desc *desc;
+    // The available ring is where the driver writes descriptor numbers
+    // that the driver would like the device to process (just the head
+    // of each chain). The ring has num elements.
+    struct virtq_avail *avail;
+    // The used ring is where the device writes descriptor numbers that
+    // the device has finished processing (just the head of each chain).
+    // The ring has num elements.
+    struct virtq_used *used;
+
+    // packed layout.
+    // The ring holds num descriptors, which the driver marks available
+    // and the device then overwrites with used descriptors, in order.
+    struct pvirtq_desc *ring;
+    struct pvirtq_event *driver_event;  // when the device should interrupt
+    struct pvirtq_event *device_event;  // when the driver should notify
+
+    // indirect descriptor tables, max_segs entries for each buffer
+    // id, in the layout of the ring; 0 without INDIRECT_DESC.
+    void *indirect;
+    int max_segs;       // segments per buffer, at most
+
+    // our own book-keeping.
+    // split: free descriptors form a stack linked through desc[].next.
+    // packed: descriptors are made available and used in ring order.
+    uint16 free_head;   // first free descriptor (split)
+    uint8 *free;        // is each descriptor on the free stack? (split)
+    uint16 num_free;    // number of free descriptors
+    uint16 used_idx;    // split: we've looked this far in used->ring.
+                        // packed: ring index of the next used descriptor.
+    uint16 kick_idx;    // avail->idx when we last considered notifying (split)
+    uint16 avail_idx;   // ring index of the next descriptor to fill (packed)
+    uint16 num_added;   // descriptors made available since the last kick (packed)
+    uint8 avail_wrap;   // driver and device ring wrap counters (packed)
+    uint8 used_wrap;
+    uint16 num;         // number of descriptors in the queue.
+    volatile uint32 *notify;  // VIRTIO_MMIO_QUEUE_NOTIFY, or 0 for no device
+    int qidx;           // queue number, written to *notify
+
+    // each buffer added to the queue carries an id below num,
+    // which virtq_get() hands back once the device has used it.
+    uint16 *head_id;    // split: id of the chain starting at each descriptor
+    uint16 *id_len;     // packed: descriptors in the buffer with each id
+};
+
+// one segment of a buffer passed to virtq_add().
+struct virtq_seg {
+    uint64 addr;
+    uint32 len;
+    int write;          // device writes (vs read)
+};
@@ -326,6 +326,9 @@ netif_add(struct netif *netif,
   netif->output_ip6 = netif_null_output_ip6;
 #endif /* LWIP_IPV6 */
   NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL);
+#if LWIP_TCP_TSO
+  netif->tso_max = 0;
+#endif /* LWIP_TCP_TSO */
   netif->mtu = 0;
   netif->flags = 0;
 #ifdef netif_get_client_data
@@ -142,6 +142,37 @@ tcp_route(const struct tcp_pcb *pcb, const ip_addr_t *src, const ip_addr_t *dst)
   }
 }
 
+#if LWIP_TCP_TSO
+/* tcp_tso_mss: largest segment tcp_write may queue for this pcb. A netif
+ * that segments TCP itself takes up to tso_max bytes of IP packet at once,
+ * provided that it cuts at our MSS, i.e. the MSS is not limited by the peer.
+ * The route is looked up once per pcb and MSS, not on every tcp_write. */
+static u16_t
+tcp_tso_mss(struct tcp_pcb *pcb)
+{
+  struct netif *netif;
+
+  if (!IP_IS_V4(&pcb->remote_ip)) {
+    return pcb->mss;
+  }
+  if ((pcb->tso_mss != 0) && (pcb->tso_mss_base == pcb->mss)) {
+    return pcb->tso_mss;
+  }
+  netif = tcp_route(pcb, &pcb->local_ip, &pcb->remote_ip);
+  if (netif == NULL) {
+    return pcb->mss;
+  }
+  pcb->tso_mss_base = pcb->mss;
+  if ((netif->tso_max <= IP_HLEN + TCP_HLEN) ||
+      (pcb->mss != netif->mtu - IP_HLEN - TCP_HLEN)) {
+    pcb->tso_mss = pcb->mss;
+  } else {
+    pcb->tso_mss = (u16_t)LWIP_MIN(netif->tso_max - IP_HLEN - TCP_HLEN, TCP_SND_BUF);
+  }
+  return pcb->tso_mss;
+}
+#endif /* LWIP_TCP_TSO */
+
 /**
  * Create a TCP segment with prefilled header.
  *
@@ -416,7 +447,11 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
   LWIP_ERROR("tcp_write: invalid pcb", pcb != NULL, return ERR_ARG);
 
   /* don't allocate segments bigger than half the maximum window we ever received */
+#if LWIP_TCP_TSO
+  mss_local = LWIP_MIN(tcp_tso_mss(pcb), TCPWND_MIN16(pcb->snd_wnd_max / 2));
+#else /* LWIP_TCP_TSO */
   mss_local = LWIP_MIN(pcb->mss, TCPWND_MIN16(pcb->snd_wnd_max / 2));
+#endif /* LWIP_TCP_TSO */
   mss_local = mss_local ? mss_local : pcb->mss;
 
   LWIP_ASSERT_CORE_LOCKED();
@@ -858,7 +893,9 @@ tcp_split_unsent_seg(struct tcp_pcb *pcb, u16_t split)
     return ERR_OK;
   }
 
+#if !LWIP_TCP_TSO
   LWIP_ASSERT("split <= mss", split <= pcb->mss);
+#endif /* !LWIP_TCP_TSO */
   LWIP_ASSERT("useg->len > 0", useg->len > 0);
 
   /* We should check that we don't exceed TCP_SND_QUEUELEN but we need
@@ -1303,6 +1340,32 @@ tcp_output(struct tcp_pcb *pcb)
     ip_addr_copy(pcb->local_ip, *local_ip);
   }
 
+#if LWIP_TCP_TSO
+  /* A segment longer than the MSS (see tcp_tso_mss) that does not fit the
+   * window is cut to the whole MSS-sized segments that do, or to one MSS,
+   * so that the window checks below work as usual */
+  if ((seg->len > pcb->mss) &&
+      (lwip_ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len > wnd)) {
+    u32_t room = wnd - LWIP_MIN(wnd, lwip_ntohl(seg->tcphdr->seqno) - pcb->lastack);
+    u16_t split = (u16_t)LWIP_MAX(room - room % pcb->mss, pcb->mss);
+    if (tcp_split_unsent_seg(pcb, split) != ERR_OK) {
+      /* No memory to split: the segment stays too long for the window.
+       * With data in flight the next ACK brings us back here; without,
+       * nothing would, so start the persist timer even if cwnd rather
+       * than snd_wnd is the limit. tcp_slowtmr splits at snd_wnd. */
+      if (pcb->unacked == NULL && pcb->persist_backoff == 0) {
+        pcb->persist_cnt = 0;
+        pcb->persist_backoff = 1;
+        pcb->persist_probe = 0;
+      }
+      if (pcb->flags & TF_ACK_NOW) {
+        return tcp_send_empty_ack(pcb);
+      }
+      goto output_done;
+    }
+  }
+#endif /* LWIP_TCP_TSO */
+
   /* Handle the current segment not fitting within the window */
   if (lwip_ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len > wnd) {
     /* We need to start the persistent timer when the next unsent segment does not fit
@@ -333,6 +333,10 @@ struct netif {
 #endif /* LWIP_CHECKSUM_CTRL_PER_NETIF*/
   /** maximum transfer unit (in bytes) */
   u16_t mtu;
+#if LWIP_TCP_TSO
+  /** largest TCP/IPv4 packet the netif segments itself (0: none) */
+  u16_t tso_max;
+#endif /* LWIP_TCP_TSO */
 #if LWIP_IPV6 && LWIP_ND6_ALLOW_RA_UPDATES
   /** maximum transfer unit (in bytes), updated by RA */
   u16_t mtu6;
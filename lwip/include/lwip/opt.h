@@ -1420,6 +1420,15 @@
 #define TCP_OVERSIZE                    TCP_MSS
 #endif
 
+/**
+ * LWIP_TCP_TSO==1: Let tcp_write() queue IPv4 segments larger than the MSS
+ * on netifs that segment TCP themselves (netif->tso_max != 0). Such
+ * segments are passed down as one IP packet of up to tso_max bytes.
+ */
+#if !defined LWIP_TCP_TSO || defined __DOXYGEN__
+#define LWIP_TCP_TSO                    0
+#endif
+
 /**
  * LWIP_TCP_TIMESTAMPS==1: support the TCP timestamp option.
  * The timestamp option is currently only used to help remote hosts, it is not
@@ -295,6 +295,11 @@ struct tcp_pcb {
   s16_t rtime;
 
   u16_t mss;   /* maximum segment size */
+#if LWIP_TCP_TSO
+  /* tcp_tso_mss() as last computed, for an mss of tso_mss_base; 0 if not yet */
+  u16_t tso_mss;
+  u16_t tso_mss_base;
+#endif /* LWIP_TCP_TSO */
 
   /* RTT (round trip time) estimation variables */
   u32_t rttest; /* RTT estimate in 500ms ticks */
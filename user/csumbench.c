@@ -0,0 +1,47 @@
+#include "kernel/types.h"
+#include "user/user.h"
+
+// compare lwIP's portable checksum with the kernel's 64-bit one,
+// alone and fused with a copy, on buffers of 64 bytes to 64 KB.
+// the kernel runs the routines on its own buffers; see csum_bench().
+// usage: csumbench [bytes per size], on a kernel built with make BENCH=1
+
+#define BYTES (16 * 1024 * 1024)
+#define MINLEN 64
+#define MAXLEN 65536
+
+// qemu's CLINT timer runs at 10 MHz
+#define NS_PER_TICK 100
+
+int main(int argc, char *argv[])
+{
+    int bytes = argc > 1 ? atoi(argv[1]) : BYTES;
+    char *name[] = { "lwip", "cksum", "copy+lwip", "cksum_copy" };
+
+    if (bytes < MAXLEN) {
+        fprintf(2, "usage: csumbench [bytes per size, at least %d]\n", MAXLEN);
+        exit(1);
+    }
+
+    printf("size");
+    for (int alg = 0; alg < 4; alg++)
+        printf("  %s", name[alg]);
+    printf("  (ns per buffer)\n");
+
+    for (int len = MINLEN; len <= MAXLEN; len *= 4) {
+        int n = bytes / len;
+        printf("%d", len);
+        for (int alg = 0; alg < 4; alg++) {
+            uint64 t = csumbench(alg, len, n);
+            if (t == -1) {
+                fprintf(2, "\ncsumbench: failed, or the routines disagree\n");
+                exit(1);
+            }
+            // ns per buffer, with one decimal
+            uint64 dns = t * NS_PER_TICK * 10 / n;
+            printf("  %d.%d", (int)(dns / 10), (int)(dns % 10));
+        }
+        printf("\n");
+    }
+    exit(0);
+}
@@ -0,0 +1,76 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/netstat.h"
+#include "user/user.h"
+
+// show the NIC's counters, like netstat -i.
+// usage: netstat [-s]
+// -s adds the drop reasons, notifications and batch sizes.
+
+static struct netstat st;
+
+static char *bucket[NETSTAT_HIST] = {
+    "0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+",
+};
+
+static void
+hist(char *name, uint64 *h)
+{
+    printf("    %s:", name);
+    for (int b = 0; b < NETSTAT_HIST; b++)
+        printf(" %s=%l", bucket[b], h[b]);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int all = argc > 1 && strcmp(argv[1], "-s") == 0;
+
+    if (argc > 2 || (argc == 2 && !all)) {
+        fprintf(2, "usage: netstat [-s]\n");
+        exit(1);
+    }
+    if (netstat(&st) < 0) {
+        fprintf(2, "netstat: failed\n");
+        exit(1);
+    }
+
+    printf("Iface Queue RX-OK RX-DRP TX-OK TX-DRP\n");
+    for (int k = 0; k < st.npairs; k++) {
+        struct netqstat *q = &st.q[k];
+        printf("en    %d     %l %l %l %l\n", k,
+               q->rx_packets, q->rx_drop_csum + q->rx_drop_nomem + q->rx_drop_bad,
+               q->tx_packets, q->tx_drop_busy + q->tx_drop_nomem);
+    }
+    if (!all)
+        exit(0);
+
+    printf("interrupts %l, network thread wakeups %l\n", st.intrs, st.wakeups);
+    printf("link: rx refused by lwIP %l, tx errors %l\n", st.link_rx_drop, st.link_tx_err);
+    printf("netd rounds over budget %l, busy polls %l\n", st.budget_used, st.busy_polls);
+    printf("loopback: %l packets, %l dropped\n", st.lo_packets, st.lo_drop);
+    printf("lwIP memory: %l pages, peak %l, limit %l\n", st.mem_pages, st.mem_peak, st.mem_limit);
+    printf("  size   in use   peak   allocs   refused\n");
+    for (int c = 0; c < NETSTAT_SLABS; c++) {
+        struct netmemstat *m = &st.mem[c];
+        printf("  %l%s   %l   %l   %l   %l\n", m->size, c == NETSTAT_SLABS - 1 ? "+" : "",
+               m->inuse, m->peak, m->allocs, m->fails);
+    }
+    printf("rx page pool: %l pages, %l free, %l trips, %l empty\n",
+           st.rxpool_pages, st.rxpool_free, st.rxpool_trips, st.rxpool_empty);
+    for (int k = 0; k < st.npairs; k++) {
+        struct netqstat *q = &st.q[k];
+        printf("queue %d:\n", k);
+        printf("  rx: packets %l bytes %l copied %l polls %l notifications %l\n",
+               q->rx_packets, q->rx_bytes, q->rx_copied, q->rx_polls, q->rx_kicks);
+        printf("  rx drops: checksum %l no memory %l bad header %l\n",
+               q->rx_drop_csum, q->rx_drop_nomem, q->rx_drop_bad);
+        hist("packets per poll", q->rx_batch);
+        printf("  tx: packets %l bytes %l ring full %l notifications %l\n",
+               q->tx_packets, q->tx_bytes, q->tx_ring_full, q->tx_kicks);
+        printf("  tx drops: busy %l no memory %l\n",
+               q->tx_drop_busy, q->tx_drop_nomem);
+        hist("frames per notification", q->tx_batch);
+    }
+    exit(0);
+}
@@ -0,0 +1,177 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/capture.h"
+#include "user/user.h"
+
+// capture frames into a pcap file, for wireshark or tcpdump -r.
+// usage: pcap [-c count] [tcp | udp | icmp | arp | port n] file
+// stops after count frames, 100 by default.
+
+struct pcap_hdr {
+    uint32 magic;
+    uint16 version_major;
+    uint16 version_minor;
+    uint32 thiszone;
+    uint32 sigfigs;
+    uint32 snaplen;
+    uint32 linktype;
+};
+
+struct pcap_rec {
+    uint32 ts_sec;
+    uint32 ts_usec;
+    uint32 incl_len;
+    uint32 orig_len;
+};
+
+#define LINKTYPE_ETHERNET 1
+
+// IPv4 and protocol proto; proto is filled in
+static struct bpf_insn ipproto[] = {
+    BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0800, 0, 3),
+    BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1),
+    BPF_STMT(BPF_RET|BPF_K, 0xffff),
+    BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+static struct bpf_insn arp[] = {
+    BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0806, 0, 1),
+    BPF_STMT(BPF_RET|BPF_K, 0xffff),
+    BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+// TCP or UDP from or to port n, which is filled in at 9 and 11.
+// fragments after the first have no ports.
+static struct bpf_insn port[] = {
+    BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 12),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0800, 0, 11),
+    BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 23),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 1, 0),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 17, 0, 8),
+    BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 20),
+    BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1fff, 6, 0),
+    BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 14),
+    BPF_STMT(BPF_LD|BPF_H|BPF_IND, 14),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 2, 0),
+    BPF_STMT(BPF_LD|BPF_H|BPF_IND, 16),
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1),
+    BPF_STMT(BPF_RET|BPF_K, 0xffff),
+    BPF_STMT(BPF_RET|BPF_K, 0),
+};
+
+// records are gathered here, and written a buffer at a time
+static char out[8192];
+static int nout;
+static int fd;
+
+static void
+flush(void)
+{
+    if (nout > 0 && write(fd, out, nout) != nout) {
+        fprintf(2, "pcap: write failed\n");
+        exit(1);
+    }
+    nout = 0;
+}
+
+static void
+put(void *p, int n)
+{
+    if (nout + n > sizeof(out))
+        flush();
+    memmove(out + nout, p, n);
+    nout += n;
+}
+
+static void
+usage(void)
+{
+    fprintf(2, "usage: pcap [-c count] [tcp | udp | icmp | arp | port n] file\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bpf_insn *prog = 0;
+    int n = 0, count = 100, i = 1;
+
+    if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+        count = atoi(argv[i+1]);
+        i += 2;
+    }
+    if (i + 1 < argc) {
+        if (strcmp(argv[i], "tcp") == 0 || strcmp(argv[i], "udp") == 0 ||
+            strcmp(argv[i], "icmp") == 0) {
+            ipproto[3].k = argv[i][0] == 't' ? 6 : argv[i][0] == 'u' ? 17 : 1;
+            prog = ipproto;
+            n = sizeof(ipproto) / sizeof(ipproto[0]);
+        } else if (strcmp(argv[i], "arp") == 0) {
+            prog = arp;
+            n = sizeof(arp) / sizeof(arp[0]);
+        } else if (strcmp(argv[i], "port") == 0 && i + 2 < argc) {
+            port[9].k = port[11].k = atoi(argv[++i]);
+            prog = port;
+            n = sizeof(port) / sizeof(port[0]);
+        } else {
+            usage();
+        }
+        i++;
+    }
+    if (i + 1 != argc || count <= 0)
+        usage();
+
+    if ((fd = open(argv[i], O_CREATE | O_WRONLY | O_TRUNC)) < 0) {
+        fprintf(2, "pcap: cannot open %s\n", argv[i]);
+        exit(1);
+    }
+
+    struct capring *r = capture(prog, n);
+    if ((uint64)r == -1) {
+        fprintf(2, "pcap: capture failed\n");
+        exit(1);
+    }
+
+    struct pcap_hdr h = {
+        .magic = 0xa1b2c3d4,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = r->snaplen,
+        .linktype = LINKTYPE_ETHERNET,
+    };
+    put(&h, sizeof(h));
+
+    // take frames in slot order, as the kernel fills them
+    int next = 0;
+    for (int got = 0; got < count; ) {
+        struct capslot *s = (struct capslot *)((char *)r + CAPSLOT0 + next * CAPSLOT);
+        if (s->status != CAP_USER) {
+            // the ring is empty: write out what we have, and wait
+            flush();
+            sleep(1);
+            continue;
+        }
+        struct pcap_rec rec = {
+            .ts_sec = s->usec / 1000000,
+            .ts_usec = s->usec % 1000000,
+            .incl_len = s->caplen,
+            .orig_len = s->len,
+        };
+        put(&rec, sizeof(rec));
+        put(s->data, s->caplen);
+        // give the slot back to the kernel
+        __sync_synchronize();
+        s->status = CAP_KERNEL;
+        next = (next + 1) % r->nslots;
+        got++;
+    }
+    flush();
+
+    printf("%d frames captured, %l dropped\n", count, r->drops);
+    capture(0, -1);
+    close(fd);
+    exit(0);
+}
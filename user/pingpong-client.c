@@ -10,7 +10,18 @@
 #define SERVER_HOST "34.176.172.133"
 #define SERVER_PORT 1234
 
-int main(){
+// usage: pingpong-client [-b usec]
+// -b sets SO_BUSY_POLL, so that read() polls the NIC for up to usec
+// microseconds before it sleeps.
+int main(int argc, char *argv[]){
+
+    int busy_poll = 0;
+    if(argc == 3 && strcmp(argv[1], "-b") == 0){
+        busy_poll = atoi(argv[2]);
+    } else if(argc != 1){
+        fprintf(2, "usage: pingpong-client [-b usec]\n");
+        exit(1);
+    }
 
     struct sockaddr serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr)); 
@@ -29,6 +40,8 @@ int main(){
     for(int i=0;i<SEND_NUM;i++){
 
         int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if(busy_poll > 0 && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) < 0)
+            printf("setsockopt failed\n");
         printf("starting connection.\n");
         if(connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr))!=0){
             printf("connect failed\n");
@@ -0,0 +1,39 @@
+#include "kernel/types.h"
+#include "user/user.h"
+
+// compare the driver's cost per frame with split and packed
+// virtqueues. the kernel passes the frames through a ring that
+// belongs to no device; see virtq_bench().
+// usage: ringbench [frames], on a kernel built with make BENCH=1
+
+#define FRAMES 1000000
+#define ROUNDS 3
+
+// qemu's CLINT timer runs at 10 MHz
+#define NS_PER_TICK 100
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : FRAMES;
+    char *name[] = { "split", "packed" };
+
+    if (n <= 0) {
+        fprintf(2, "usage: ringbench [frames]\n");
+        exit(1);
+    }
+
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int packed = 0; packed < 2; packed++) {
+            uint64 t = ringbench(packed, n);
+            if (t == -1) {
+                fprintf(2, "ringbench: failed\n");
+                exit(1);
+            }
+            // ns per frame, with one decimal
+            uint64 dns = t * NS_PER_TICK * 10 / n;
+            printf("%s: %d frames in %l ticks, %d.%d ns/frame\n",
+                   name[packed], n, t, (int)(dns / 10), (int)(dns % 10));
+        }
+    }
+    exit(0);
+}
@@ -0,0 +1,126 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/spinlock.h"
+#include "kernel/socket.h"
+#include "user/user.h"
+
+// send datagrams over the loopback interface with sendmmsg() and
+// receive them with recvmmsg(), batch datagrams per call, and
+// report how many arrived and how long it took. a child receives,
+// the parent sends.
+// usage: udpbench [datagrams [bytes [batch]]]
+
+#define DGRAMS 100000
+#define BYTES 64
+#define BATCH 16
+#define MAXBATCH 64
+#define PORT 5001
+
+// sent after the data, until the receiver is likely done
+#define ENDS 5
+
+static char *buf[MAXBATCH];
+static struct mmsghdr msgs[MAXBATCH];
+
+static void receiver(int sock, int len, int batch)
+{
+    int got = 0, trunc = 0;
+    uint start = 0;
+
+    for (;;) {
+        for (int i = 0; i < batch; i++) {
+            msgs[i].msg_buf = buf[i];
+            msgs[i].msg_len = len + 1;
+        }
+        int n = recvmmsg(sock, msgs, batch, 0);
+        if (n < 0) {
+            fprintf(2, "udpbench: recvmmsg failed\n");
+            exit(1);
+        }
+        if (got == 0)
+            start = timenow();
+        for (int i = 0; i < n; i++) {
+            // an empty datagram marks the end
+            if (msgs[i].msg_len == 0) {
+                printf("received %d datagrams (%d truncated) in %d ticks\n",
+                       got, trunc, timenow() - start);
+                exit(0);
+            }
+            if (msgs[i].msg_flags & MSG_TRUNC)
+                trunc++;
+            got++;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : DGRAMS;
+    int len = argc > 2 ? atoi(argv[2]) : BYTES;
+    int batch = argc > 3 ? atoi(argv[3]) : BATCH;
+
+    if (n <= 0 || len <= 0 || len > UDP_MAXLEN || batch <= 0 || batch > MAXBATCH) {
+        fprintf(2, "usage: udpbench [datagrams [bytes (at most %d) [batch (at most %d)]]]\n",
+                UDP_MAXLEN, MAXBATCH);
+        exit(1);
+    }
+
+    // a byte more than is sent, so that MSG_TRUNC would be a bug
+    for (int i = 0; i < batch; i++) {
+        if ((buf[i] = malloc(len + 1)) == 0) {
+            fprintf(2, "udpbench: out of memory\n");
+            exit(1);
+        }
+    }
+
+    struct sockaddr addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sa_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    inetaddress("127.0.0.1", &addr);
+
+    int rsock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (rsock < 0 || bind(rsock, &addr, sizeof(addr)) < 0) {
+        fprintf(2, "udpbench: cannot bind port %d\n", PORT);
+        exit(1);
+    }
+    if (fork() == 0)
+        receiver(rsock, len, batch);
+    close(rsock);
+
+    int ssock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ssock < 0 || connect(ssock, &addr, sizeof(addr)) < 0) {
+        fprintf(2, "udpbench: cannot connect to port %d\n", PORT);
+        exit(1);
+    }
+
+    // to the connected peer: msg_name.sa_family is 0
+    for (int i = 0; i < batch; i++) {
+        memset(buf[i], 'a' + i % 26, len);
+        msgs[i].msg_buf = buf[i];
+        msgs[i].msg_len = len;
+    }
+
+    int sent = 0;
+    uint start = timenow();
+    while (sent < n) {
+        int m = n - sent < batch ? n - sent : batch;
+        int r = sendmmsg(ssock, msgs, m, 0);
+        if (r < 0) {
+            fprintf(2, "udpbench: sendmmsg failed\n");
+            exit(1);
+        }
+        sent += r;
+    }
+    printf("sent %d datagrams of %d bytes, %d per call, in %d ticks\n",
+           sent, len, batch, timenow() - start);
+
+    msgs[0].msg_len = 0;
+    for (int i = 0; i < ENDS; i++) {
+        sendmmsg(ssock, msgs, 1, 0);
+        sleep(1);
+    }
+    close(ssock);
+    wait(0);
+    exit(0);
+}
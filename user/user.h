@@ -1,6 +1,10 @@
 struct stat;
 struct rtcdate;
 struct sockaddr;
+struct mmsghdr;
+struct netstat;
+struct capring;
+struct bpf_insn;
 
 // system calls
 int fork(void);
@@ -34,6 +38,13 @@ int accept(int, struct sockaddr*, int*);
 int gethostbyname(const char*, struct sockaddr*);
 int inetaddress(const char*, struct sockaddr*);
 uint timenow();
+uint64 ringbench(int, int);
+int netstat(struct netstat*);
+int setsockopt(int, int, int, const void*, int);
+struct capring* capture(struct bpf_insn*, int);
+uint64 csumbench(int, int, int);
+int sendmmsg(int, struct mmsghdr*, int, int);
+int recvmmsg(int, struct mmsghdr*, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
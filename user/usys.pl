@@ -45,4 +45,11 @@ entry("listen");
 entry("accept");
 entry("gethostbyname");
 entry("inetaddress");
-entry("timenow");
\ No newline at end of file
+entry("timenow");
+entry("ringbench");
+entry("netstat");
+entry("setsockopt");
+entry("capture");
+entry("csumbench");
+entry("sendmmsg");
+entry("recvmmsg");